@@ -167,6 +167,125 @@ struct Gason {
     }
 };
 
+struct GasonTape {
+    std::vector<char> source;
+    JsonTape tape;
+    char *endptr;
+    int result;
+
+    bool parse(const std::vector<char> &buffer) {
+        source = buffer;
+        return (result = jsonParse(source.data(), &endptr, tape)) == JSON_OK;
+    }
+    const char *strError() {
+        return jsonStrError(result);
+    }
+    void update(Stat &stat) {
+        // Tape is in document order and keys are string entries, so no
+        // recursion or pointer chasing needed.
+        JsonTapeValue root = tape.root();
+        for (const JsonValue *p = root.p, *end = root.skip(); p != end; ++p) {
+            switch (p->getTag()) {
+            case JSON_ARRAY:
+                stat.arrayCount++;
+                break;
+            case JSON_OBJECT:
+                stat.objectCount++;
+                break;
+            case JSON_STRING:
+                stat.stringCount++;
+                break;
+            case JSON_NUMBER:
+                stat.numberCount++;
+                break;
+            case JSON_TRUE:
+                stat.trueCount++;
+                break;
+            case JSON_FALSE:
+                stat.falseCount++;
+                break;
+            case JSON_NULL:
+                stat.nullCount++;
+                break;
+            }
+        }
+    }
+    static const char *name() {
+        return "gason tape";
+    }
+};
+
+struct GasonEvents {
+    std::vector<char> source;
+    Stat counts;
+    char *endptr;
+    int result;
+
+    // Counts are gathered by handler while parsing, no tree is built.
+    struct Handler {
+        Stat &stat;
+        int startArray() {
+            stat.arrayCount++;
+            return JSON_OK;
+        }
+        int endArray() {
+            return JSON_OK;
+        }
+        int startObject() {
+            stat.objectCount++;
+            return JSON_OK;
+        }
+        int endObject() {
+            return JSON_OK;
+        }
+        int key(char *, size_t) {
+            stat.stringCount++;
+            return JSON_OK;
+        }
+        int string(char *, size_t) {
+            stat.stringCount++;
+            return JSON_OK;
+        }
+        int number(double) {
+            stat.numberCount++;
+            return JSON_OK;
+        }
+        int boolean(bool x) {
+            if (x)
+                stat.trueCount++;
+            else
+                stat.falseCount++;
+            return JSON_OK;
+        }
+        int null() {
+            stat.nullCount++;
+            return JSON_OK;
+        }
+    };
+
+    bool parse(const std::vector<char> &buffer) {
+        source = buffer;
+        memset(&counts, 0, sizeof(counts));
+        Handler handler{counts};
+        return (result = jsonParseEvents(source.data(), &endptr, handler)) == JSON_OK;
+    }
+    const char *strError() {
+        return jsonStrError(result);
+    }
+    void update(Stat &stat) {
+        stat.numberCount += counts.numberCount;
+        stat.stringCount += counts.stringCount;
+        stat.objectCount += counts.objectCount;
+        stat.arrayCount += counts.arrayCount;
+        stat.falseCount += counts.falseCount;
+        stat.trueCount += counts.trueCount;
+        stat.nullCount += counts.nullCount;
+    }
+    static const char *name() {
+        return "gason events";
+    }
+};
+
 template <typename T>
 static Stat run(size_t iterations, const std::vector<char> &buffer) {
     Stat stat;
@@ -252,6 +371,8 @@ int main(int argc, const char **argv) {
         print(run<Rapid>(iterations, buffer));
         print(run<RapidInsitu>(iterations, buffer));
         print(run<Gason>(iterations, buffer));
+        print(run<GasonTape>(iterations, buffer));
+        print(run<GasonEvents>(iterations, buffer));
     }
     return 0;
 }
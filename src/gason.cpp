@@ -1,8 +1,23 @@
 #include "gason.h"
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <thread>
+#include <vector>
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #define JSON_ZONE_SIZE 4096
-#define JSON_STACK_SIZE 32
+#define JSON_HUGE_PAGE_SIZE (2 << 20) // where system can not be asked
+// from <numaif.h>, which comes with libnuma rather than libc
+#define JSON_MPOL_PREFERRED 1
 
 const char *jsonStrError(int err) {
     switch (err) {
@@ -16,6 +31,126 @@ const char *jsonStrError(int err) {
     }
 }
 
+static inline void *zonePointer(uint64_t x) {
+    return (void *)(uintptr_t)(x & JSON_VALUE_PAYLOAD_MASK);
+}
+
+// Size of transparent huge page, which is 2 MB on x86-64 but 512 MB on ARM64
+// with 64 KB pages.
+static size_t hugePageSize() {
+    size_t size = 0;
+#if defined(__linux__)
+    if (FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r")) {
+        unsigned long long n;
+        if (fscanf(fp, "%llu", &n) == 1 && n && !(n & (n - 1)))
+            size = n;
+        fclose(fp);
+    }
+#endif
+    return size ? size : JSON_HUGE_PAGE_SIZE;
+}
+
+JsonArena::JsonArena(size_t size) : base(nullptr), reserved(0), used(0), hugetlb(false) {
+    size_t huge = hugePageSize();
+    size = (size + huge - 1) & ~(huge - 1);
+#if !defined(_WIN32)
+    void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    // fails at once unless enough huge pages are reserved by administrator
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    hugetlb = p != MAP_FAILED;
+#endif
+    if (p == MAP_FAILED) {
+        // reserve extra huge page to align region, so that transparent huge
+        // pages can back all of it
+        size_t padded = size + huge;
+        p = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return;
+        char *aligned = (char *)(((uintptr_t)p + huge - 1) & ~(uintptr_t)(huge - 1));
+        if (aligned != p)
+            munmap(p, aligned - (char *)p);
+        munmap(aligned + size, (char *)p + padded - (aligned + size));
+        p = aligned;
+#if defined(MADV_HUGEPAGE)
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+#if defined(__linux__) && defined(SYS_getcpu) && defined(SYS_mbind)
+    // pages are not touched yet, so policy decides where all of them go;
+    // preferred rather than bound node falls back instead of failing
+    unsigned cpu, node;
+    unsigned long mask[16] = {};
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 && node < sizeof(mask) * 8) {
+        mask[node / (sizeof(long) * 8)] = 1UL << node % (sizeof(long) * 8);
+        syscall(SYS_mbind, p, size, JSON_MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+    }
+#endif
+    base = (char *)p;
+#else
+    base = (char *)malloc(size);
+    if (!base)
+        return;
+#endif
+    reserved = size;
+}
+
+JsonArena::~JsonArena() {
+    if (!base)
+        return;
+#if !defined(_WIN32)
+    munmap(base, reserved);
+#else
+    free(base);
+#endif
+}
+
+void *JsonArena::pop() {
+    return pop(JSON_ZONE_SIZE);
+}
+
+void *JsonArena::pop(size_t size) {
+    size = (size + JSON_ZONE_SIZE - 1) & ~(size_t)(JSON_ZONE_SIZE - 1);
+    if (used.load(std::memory_order_relaxed) + size > reserved)
+        return nullptr;
+    size_t offset = used.fetch_add(size, std::memory_order_relaxed);
+    return offset + size <= reserved ? base + offset : nullptr;
+}
+
+JsonZonePool::~JsonZonePool() {
+    void *zone = zonePointer(top.load(std::memory_order_acquire));
+    while (zone) {
+        void *next = *(void **)zone;
+        // zones of arena are unmapped with it
+        if (!arena || !arena->contains(zone))
+            free(zone);
+        zone = next;
+    }
+}
+
+void *JsonZonePool::pop() {
+    // Zones are never freed while pool lives, so reading next of zone that
+    // was just taken by other thread is safe, counter makes CAS fail then.
+    uint64_t x = top.load(std::memory_order_acquire);
+    while (zonePointer(x)) {
+        void *next = *(void **)zonePointer(x);
+        uint64_t y = (x & ~JSON_VALUE_PAYLOAD_MASK) + (JSON_VALUE_PAYLOAD_MASK + 1) + (uintptr_t)next;
+        if (top.compare_exchange_weak(x, y, std::memory_order_acq_rel, std::memory_order_acquire))
+            return zonePointer(x);
+    }
+    return arena ? arena->pop() : nullptr;
+}
+
+void JsonZonePool::push(void *first, void *last) {
+    assert((uintptr_t)first <= JSON_VALUE_PAYLOAD_MASK);
+    uint64_t x = top.load(std::memory_order_relaxed);
+    uint64_t y;
+    do {
+        *(void **)last = zonePointer(x);
+        y = (x & ~JSON_VALUE_PAYLOAD_MASK) + (JSON_VALUE_PAYLOAD_MASK + 1) + (uintptr_t)first;
+    } while (!top.compare_exchange_weak(x, y, std::memory_order_release, std::memory_order_relaxed));
+}
+
 void *JsonAllocator::allocate(size_t size) {
     size = (size + 7) & ~7;
 
@@ -26,7 +161,13 @@ void *JsonAllocator::allocate(size_t size) {
     }
 
     size_t allocSize = sizeof(Zone) + size;
-    Zone *zone = (Zone *)malloc(allocSize <= JSON_ZONE_SIZE ? JSON_ZONE_SIZE : allocSize);
+    Zone *zone = nullptr;
+    if (pool && allocSize <= JSON_ZONE_SIZE)
+        zone = (Zone *)pool->pop();
+    else if (pool)
+        zone = (Zone *)pool->popBlock(allocSize);
+    if (zone == nullptr)
+        zone = (Zone *)malloc(allocSize <= JSON_ZONE_SIZE ? JSON_ZONE_SIZE : allocSize);
     if (zone == nullptr)
         return nullptr;
     zone->used = allocSize;
@@ -41,294 +182,2192 @@ void *JsonAllocator::allocate(size_t size) {
 }
 
 void JsonAllocator::deallocate() {
+    Zone *first = nullptr, *last = nullptr;
     while (head) {
         Zone *next = head->next;
-        free(head);
+        if (pool && head->used <= JSON_ZONE_SIZE) {
+            // regular zones go back to pool in one push
+            head->next = first;
+            first = head;
+            if (!last)
+                last = head;
+        } else if (!pool || !pool->owns(head)) {
+            free(head);
+        }
         head = next;
     }
+    if (first)
+        pool->push(first, last);
 }
 
-static inline bool isspace(char c) {
-    return c == ' ' || (c >= '\t' && c <= '\r');
+bool JsonAllocator::merge(JsonAllocator &x) {
+    if (pool && x.pool && pool != x.pool)
+        return false;
+    if (!x.head)
+        return true;
+    // zones of arena must not reach free()
+    if (!pool)
+        pool = x.pool;
+    if (!head) {
+        head = x.head;
+    } else {
+        // keep current zone first, it is the one with free space
+        Zone *last = x.head;
+        while (last->next)
+            last = last->next;
+        last->next = head->next;
+        head->next = x.head;
+    }
+    x.head = nullptr;
+    return true;
 }
 
-static inline bool isdelim(char c) {
-    return c == ',' || c == ':' || c == ']' || c == '}' || isspace(c) || !c;
+static inline JsonNode *insertAfter(JsonNode *tail, JsonNode *node) {
+    if (!tail)
+        return node->next = node;
+    node->next = tail->next;
+    tail->next = node;
+    return node;
 }
 
-static inline bool isdigit(char c) {
-    return c >= '0' && c <= '9';
+static inline JsonValue listToValue(JsonTag tag, JsonNode *tail) {
+    if (tail) {
+        auto head = tail->next;
+        tail->next = nullptr;
+        return JsonValue(tag, head);
+    }
+    return JsonValue(tag, nullptr);
 }
 
-static inline bool isxdigit(char c) {
-    return (c >= '0' && c <= '9') || ((c & ~' ') >= 'A' && (c & ~' ') <= 'F');
-}
+struct JsonTreeBuilder {
+    JsonAllocator &allocator;
+    JsonValue *value;
+    JsonNode *tails[JSON_STACK_SIZE];
+    char *keys[JSON_STACK_SIZE];
+    bool objects[JSON_STACK_SIZE];
+    int pos;
+
+    JsonTreeBuilder(JsonAllocator &allocator, JsonValue *value)
+        : allocator(allocator), value(value), pos(-1) {
+    }
+    int add(JsonValue o) {
+        if (pos == -1) {
+            *value = o;
+            return JSON_OK;
+        }
+        JsonNode *node;
+        if (keys[pos]) {
+            if ((node = (JsonNode *)allocator.allocate(sizeof(JsonNode))) == nullptr)
+                return JSON_ALLOCATION_FAILURE;
+            tails[pos] = insertAfter(tails[pos], node);
+            tails[pos]->key = keys[pos];
+            keys[pos] = nullptr;
+        } else {
+            if ((node = (JsonNode *)allocator.allocate(sizeof(JsonNode) - sizeof(char *))) == nullptr)
+                return JSON_ALLOCATION_FAILURE;
+            tails[pos] = insertAfter(tails[pos], node);
+        }
+        tails[pos]->value = o;
+        return JSON_OK;
+    }
+    int start(bool object) {
+        ++pos;
+        tails[pos] = nullptr;
+        keys[pos] = nullptr;
+        objects[pos] = object;
+        return JSON_OK;
+    }
+    int startArray() {
+        return start(false);
+    }
+    int startObject() {
+        return start(true);
+    }
+    int endArray() {
+        JsonValue o = listToValue(JSON_ARRAY, tails[pos--]);
+        return add(o);
+    }
+    int endObject() {
+        JsonValue o = listToValue(JSON_OBJECT, tails[pos--]);
+        return add(o);
+    }
+    int key(char *s, size_t) {
+        keys[pos] = s;
+        return JSON_OK;
+    }
+    int string(char *s, size_t) {
+        return add(JsonValue(JSON_STRING, s));
+    }
+    int number(double x) {
+        return add(JsonValue(x));
+    }
+    int boolean(bool x) {
+        return add(JsonValue(x ? JSON_TRUE : JSON_FALSE));
+    }
+    int null() {
+        return add(JsonValue(JSON_NULL));
+    }
+    // JSON Pointer of value being parsed: pending key of every object level
+    // and count of elements already added to every array level. Measures
+    // length when out is null.
+    size_t path(char *out) {
+        size_t size = 0;
+        for (int i = 0; i <= pos; ++i) {
+            if (objects[i]) {
+                if (!keys[i])
+                    continue;
+                if (out)
+                    out[size] = '/';
+                ++size;
+                for (const char *k = keys[i]; *k; ++k) {
+                    if (*k == '~' || *k == '/') {
+                        if (out) {
+                            out[size] = '~';
+                            out[size + 1] = *k == '~' ? '0' : '1';
+                        }
+                        size += 2;
+                    } else {
+                        if (out)
+                            out[size] = *k;
+                        ++size;
+                    }
+                }
+            } else {
+                size_t index = 0;
+                if (tails[i]) {
+                    JsonNode *node = tails[i];
+                    do {
+                        ++index;
+                        node = node->next;
+                    } while (node != tails[i]);
+                }
+                char buffer[24];
+                char *s = buffer + sizeof(buffer);
+                do
+                    *--s = '0' + index % 10;
+                while (index /= 10);
+                *--s = '/';
+                size_t n = buffer + sizeof(buffer) - s;
+                if (out)
+                    memcpy(out + size, s, n);
+                size += n;
+            }
+        }
+        return size;
+    }
+};
 
-static inline int char2int(char c) {
-    if (c <= '9')
-        return c - '0';
-    return (c & ~' ') - 'A' + 10;
+int jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator) {
+    JsonTreeBuilder builder(allocator, value);
+    return jsonParseEvents(s, endptr, builder);
 }
 
-static double string2double(char *s, char **endptr) {
-    char ch = *s;
-    if (ch == '-')
-        ++s;
+void jsonLocate(const char *str, const char *endptr, size_t *line, size_t *column) {
+    const char *start = str;
+    size_t lines = 1;
+    for (const char *s = str; s < endptr; ++s) {
+        if (*s == '\n') {
+            ++lines;
+            start = s + 1;
+        } else if (*s == JSON_STRING_MARK) {
+            // unescaped text runs up to terminating zero, rest of original
+            // string after it has no raw newlines
+            while (s + 1 < endptr && s[1])
+                ++s;
+        }
+    }
+    *line = lines;
+    *column = endptr - start + 1;
+}
 
-    double result = 0;
-    while (isdigit(*s))
-        result = (result * 10) + (*s++ - '0');
+static void locateError(JsonError *error, char *str, char *endptr) {
+    error->offset = endptr - str;
+    jsonLocate(str, endptr, &error->line, &error->column);
+    error->path = "";
+}
 
-    if (*s == '.') {
-        ++s;
+int jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator, JsonError *error) {
+    JsonTreeBuilder builder(allocator, value);
+    int status = jsonParseEvents(s, endptr, builder, error != nullptr);
+    if (status != JSON_OK && error) {
+        locateError(error, s, *endptr);
+        size_t size = builder.path(nullptr);
+        char *path = (char *)allocator.allocate(size + 1);
+        if (path) {
+            builder.path(path);
+            path[size] = 0;
+            error->path = path;
+        }
+    }
+    return status;
+}
 
-        double fraction = 1;
-        while (isdigit(*s)) {
-            fraction *= 0.1;
-            result += (*s++ - '0') * fraction;
+bool jsonParseRecord(JsonRecords &records, int *status, JsonValue *value, JsonAllocator &allocator, JsonError *error) {
+    char *s = records.next;
+    while (*s) {
+        ++records.line;
+        char *eol = strchr(s, '\n');
+        char *next = eol ? eol + 1 : s + strlen(s);
+        if (eol)
+            *eol = 0;
+        char *it = s;
+        while (jsonIsSpace(*it))
+            ++it;
+        if (!*it) {
+            s = next;
+            continue;
+        }
+        records.next = next;
+        char *endptr;
+        *status = jsonParse(s, &endptr, value, allocator, error);
+        if (*status == JSON_OK) {
+            while (jsonIsSpace(*endptr))
+                ++endptr;
+            if (!*endptr)
+                return true;
+            *status = JSON_UNEXPECTED_CHARACTER;
+            if (error)
+                locateError(error, s, endptr);
         }
+        if (error) {
+            error->offset += s - records.text;
+            error->line += records.line - 1;
+        }
+        return true;
     }
+    records.next = s;
+    return false;
+}
 
-    if (*s == 'e' || *s == 'E') {
-        ++s;
+// Projection is object tree of selected keys, member which is not an object
+// selects whole subtree, arrays pass projection to every element.
+struct JsonProjectionBuilder : JsonTreeBuilder {
+    JsonValue projections[JSON_STACK_SIZE];
+    JsonValue selected;
 
-        double base = 10;
-        if (*s == '+')
-            ++s;
-        else if (*s == '-') {
-            ++s;
-            base = 0.1;
+    JsonProjectionBuilder(JsonAllocator &allocator, JsonValue *value, JsonValue projection)
+        : JsonTreeBuilder(allocator, value), selected(projection) {
+    }
+    int start(bool object) {
+        projections[pos + 1] = selected;
+        return JsonTreeBuilder::start(object);
+    }
+    int end() {
+        if (pos != -1)
+            selected = projections[pos];
+        return JSON_OK;
+    }
+    int startArray() {
+        return start(false);
+    }
+    int startObject() {
+        return start(true);
+    }
+    int endArray() {
+        int status = JsonTreeBuilder::endArray();
+        return status != JSON_OK ? status : end();
+    }
+    int endObject() {
+        int status = JsonTreeBuilder::endObject();
+        return status != JSON_OK ? status : end();
+    }
+    int key(char *s, size_t size) {
+        JsonValue projection = projections[pos];
+        if (projection.getTag() == JSON_OBJECT) {
+            for (auto i : projection) {
+                if (!strcmp(i->key, s)) {
+                    selected = i->value;
+                    return JsonTreeBuilder::key(s, size);
+                }
+            }
+            return JSON_SKIP;
         }
+        selected = projection;
+        return JsonTreeBuilder::key(s, size);
+    }
+};
+
+int jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator, JsonValue projection) {
+    JsonProjectionBuilder builder(allocator, value, projection);
+    return jsonParseEvents(s, endptr, builder);
+}
 
-        unsigned int exponent = 0;
-        while (isdigit(*s))
-            exponent = (exponent * 10) + (*s++ - '0');
+#define JSON_DEADLINE_INTERVAL 4096
 
-        double power = 1;
-        for (; exponent; exponent >>= 1, base *= base)
-            if (exponent & 1)
-                power *= base;
+// Charges every value before its node is allocated, so budget is never
+// exceeded by more than one node.
+struct JsonLimitedBuilder : JsonTreeBuilder {
+    const JsonLimits &limits;
+    size_t values;
+    size_t memory;
+
+    JsonLimitedBuilder(JsonAllocator &allocator, JsonValue *value, const JsonLimits &limits)
+        : JsonTreeBuilder(allocator, value), limits(limits), values(0), memory(0) {
+    }
+    int charge() {
+        // root is the only value without node
+        if (pos != -1)
+            memory += keys[pos] ? sizeof(JsonNode) : sizeof(JsonNode) - sizeof(char *);
+        ++values;
+        if (limits.nodes && values > limits.nodes)
+            return JSON_TOO_MANY_NODES;
+        if (limits.memory && memory > limits.memory)
+            return JSON_MEMORY_LIMIT;
+        if (values % JSON_DEADLINE_INTERVAL == 0 && limits.deadline != std::chrono::steady_clock::time_point() &&
+            std::chrono::steady_clock::now() > limits.deadline)
+            return JSON_DEADLINE_EXCEEDED;
+        return JSON_OK;
+    }
+    int startArray() {
+        int status = charge();
+        return status != JSON_OK ? status : JsonTreeBuilder::startArray();
+    }
+    int startObject() {
+        int status = charge();
+        return status != JSON_OK ? status : JsonTreeBuilder::startObject();
+    }
+    int key(char *s, size_t size) {
+        if (limits.string && size > limits.string)
+            return JSON_STRING_TOO_LONG;
+        return JsonTreeBuilder::key(s, size);
+    }
+    int string(char *s, size_t size) {
+        if (limits.string && size > limits.string)
+            return JSON_STRING_TOO_LONG;
+        int status = charge();
+        return status != JSON_OK ? status : JsonTreeBuilder::string(s, size);
+    }
+    int number(double x) {
+        int status = charge();
+        return status != JSON_OK ? status : JsonTreeBuilder::number(x);
+    }
+    int boolean(bool x) {
+        int status = charge();
+        return status != JSON_OK ? status : JsonTreeBuilder::boolean(x);
+    }
+    int null() {
+        int status = charge();
+        return status != JSON_OK ? status : JsonTreeBuilder::null();
+    }
+};
 
-        result *= power;
+int jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator, const JsonLimits &limits) {
+    // memchr is much faster than tokenizer, so oversized text costs little
+    if (limits.input && !memchr(s, 0, limits.input + 1)) {
+        *endptr = s + limits.input;
+        return JSON_INPUT_TOO_LARGE;
     }
+    JsonLimitedBuilder builder(allocator, value, limits);
+    return jsonParseEvents(s, endptr, builder);
+}
 
-    *endptr = s;
-    return ch == '-' ? -result : result;
+void JsonDocument::release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // document lives in its own allocator
+        JsonAllocator owner(static_cast<JsonAllocator &&>(allocator));
+        this->~JsonDocument();
+    }
 }
 
-static inline JsonNode *insertAfter(JsonNode *tail, JsonNode *node) {
-    if (!tail)
-        return node->next = node;
-    node->next = tail->next;
-    tail->next = node;
-    return node;
+int jsonParse(const char *text, size_t size, JsonDocument **document, JsonZonePool *pool) {
+    JsonAllocator allocator;
+    if (pool)
+        allocator = JsonAllocator(*pool);
+    void *place = allocator.allocate(sizeof(JsonDocument));
+    char *source = (char *)allocator.allocate(size + 1);
+    if (place == nullptr || source == nullptr)
+        return JSON_ALLOCATION_FAILURE;
+    memcpy(source, text, size);
+    source[size] = 0;
+    char *endptr;
+    JsonValue value;
+    int status = jsonParse(source, &endptr, &value, allocator);
+    if (status != JSON_OK)
+        return status;
+    *document = new (place) JsonDocument(static_cast<JsonAllocator &&>(allocator), value);
+    return JSON_OK;
 }
 
-static inline JsonValue listToValue(JsonTag tag, JsonNode *tail) {
-    if (tail) {
-        auto head = tail->next;
-        tail->next = nullptr;
-        return JsonValue(tag, head);
+// Shifts string and key pointers at or after from in list starting at node
+// and in subtrees of its nodes.
+static void rebase(JsonNode *node, bool object, char *from, ptrdiff_t delta) {
+    JsonNode *lists[JSON_STACK_SIZE];
+    bool objects[JSON_STACK_SIZE];
+    int pos = 0;
+    lists[0] = node;
+    objects[0] = object;
+    while (pos != -1) {
+        JsonNode *node = lists[pos];
+        if (!node) {
+            --pos;
+            continue;
+        }
+        lists[pos] = node->next;
+        if (objects[pos] && node->key >= from)
+            node->key += delta;
+        switch (node->value.getTag()) {
+        case JSON_STRING:
+            if (node->value.toString() >= from)
+                node->value = JsonValue(JSON_STRING, node->value.toString() + delta);
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            lists[++pos] = node->value.toNode();
+            objects[pos] = node->value.getTag() == JSON_OBJECT;
+            break;
+        default:
+            break;
+        }
     }
-    return JsonValue(tag, nullptr);
 }
 
-int jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator) {
-    JsonNode *tails[JSON_STACK_SIZE];
-    JsonTag tags[JSON_STACK_SIZE];
-    char *keys[JSON_STACK_SIZE];
-    JsonValue o;
-    int pos = -1;
-    bool separator = true;
-    JsonNode *node;
-    *endptr = s;
+// First byte of value in source. Known only for values that hold string or
+// key pointer: strings and non-empty containers, brackets are found by going
+// back over whitespace.
+static char *valueStart(JsonValue o) {
+    char *s;
+    switch (o.getTag()) {
+    case JSON_STRING:
+        return o.toString() - 1;
+    case JSON_OBJECT:
+        if (!o.toNode())
+            return nullptr;
+        s = o.toNode()->key - 1;
+        break;
+    case JSON_ARRAY:
+        if (!o.toNode() || !(s = valueStart(o.toNode()->value)))
+            return nullptr;
+        break;
+    default:
+        return nullptr;
+    }
+    do
+        --s;
+    while (jsonIsSpace(*s));
+    return s;
+}
 
-    while (*s) {
-        while (isspace(*s)) {
-            ++s;
-            if (!*s) break;
-        }
-        *endptr = s++;
-        switch (**endptr) {
-        case '-':
-            if (!isdigit(*s) && *s != '.') {
-                *endptr = s;
-                return JSON_BAD_NUMBER;
+// Member starts at opening quote of key, element at first byte of value.
+static char *nodeStart(JsonNode *node, bool object) {
+    return object ? node->key - 1 : valueStart(node->value);
+}
+
+// Checks that text between reparsed value and next sibling closes the same
+// containers as before, innermost first, with no more than one comma in a row.
+static bool sameClosers(const char *s, const char *end, const char *closers, int count, bool last) {
+    bool comma = false;
+    int closed = 0;
+    for (; s != end; ++s) {
+        if (jsonIsSpace(*s))
+            continue;
+        if (*s == ',' && !comma) {
+            comma = true;
+        } else if (closed < count && *s == closers[closed]) {
+            comma = false;
+            if (++closed == count && last)
+                return true;
+        } else {
+            return false;
+        }
+    }
+    return closed == count;
+}
+
+int jsonReparse(char *source, const char *text, size_t size, JsonEdit edit, char **endptr, JsonValue *value, JsonAllocator &allocator) {
+    size_t oldSize = size - edit.inserted + edit.removed;
+    size_t last = edit.offset + edit.removed;
+    JsonNode *path[JSON_STACK_SIZE]; // node enclosing edit on every level
+    bool objects[JSON_STACK_SIZE];
+    size_t begins[JSON_STACK_SIZE];
+    size_t finishes[JSON_STACK_SIZE];
+    int depth = 0;
+
+    // find deepest member or element whose span, from its start to start of
+    // next sibling, strictly contains edit; array elements that cannot be
+    // located stop the descent
+    JsonValue o = *value;
+    size_t limit = oldSize;
+    while (last <= oldSize && (o.getTag() == JSON_OBJECT || o.getTag() == JSON_ARRAY) && o.toNode()) {
+        bool object = o.getTag() == JSON_OBJECT;
+        JsonNode *found = nullptr;
+        char *a = nodeStart(o.toNode(), object);
+        for (JsonNode *i = o.toNode(); i && a; i = i->next) {
+            char *b = i->next ? nodeStart(i->next, object) : source + limit;
+            if (!b)
+                break;
+            if (a >= b || b > source + limit) {
+                depth = 0;
+                break;
             }
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-            o = JsonValue(string2double(*endptr, &s));
-            if (!isdelim(*s)) {
-                *endptr = s;
-                return JSON_BAD_NUMBER;
+            if ((size_t)(a - source) < edit.offset && last <= (size_t)(b - source)) {
+                found = i;
+                begins[depth] = a - source;
+                finishes[depth] = b - source;
+                break;
             }
+            a = b;
+        }
+        if (!found)
             break;
-        case '"':
-            o = JsonValue(JSON_STRING, s);
-            for (char *it = s; *s; ++it, ++s) {
-                int c = *it = *s;
-                if (c == '\\') {
-                    c = *++s;
-                    switch (c) {
-                    case '\\':
-                    case '"':
-                    case '/':
-                        *it = c;
-                        break;
-                    case 'b':
-                        *it = '\b';
-                        break;
-                    case 'f':
-                        *it = '\f';
-                        break;
-                    case 'n':
-                        *it = '\n';
-                        break;
-                    case 'r':
-                        *it = '\r';
-                        break;
-                    case 't':
-                        *it = '\t';
-                        break;
-                    case 'u':
-                        c = 0;
-                        for (int i = 0; i < 4; ++i) {
-                            if (isxdigit(*++s)) {
-                                c = c * 16 + char2int(*s);
-                            } else {
-                                *endptr = s;
-                                return JSON_BAD_STRING;
-                            }
-                        }
-                        if (c < 0x80) {
-                            *it = c;
-                        } else if (c < 0x800) {
-                            *it++ = 0xC0 | (c >> 6);
-                            *it = 0x80 | (c & 0x3F);
-                        } else {
-                            *it++ = 0xE0 | (c >> 12);
-                            *it++ = 0x80 | ((c >> 6) & 0x3F);
-                            *it = 0x80 | (c & 0x3F);
-                        }
-                        break;
-                    default:
-                        *endptr = s;
-                        return JSON_BAD_STRING;
-                    }
-                } else if ((unsigned int)c < ' ' || c == '\x7F') {
-                    *endptr = s;
-                    return JSON_BAD_STRING;
-                } else if (c == '"') {
-                    *it = 0;
+        path[depth] = found;
+        objects[depth++] = object;
+        o = found->value;
+        limit = finishes[depth - 1];
+    }
+
+    if (depth) {
+        // only nodes after deepest span point past it, text before it stays
+        size_t finish = finishes[depth - 1];
+        ptrdiff_t delta = (ptrdiff_t)edit.inserted - (ptrdiff_t)edit.removed;
+        if (delta) {
+            memmove(source + finish + delta, source + finish, oldSize - finish + 1);
+            for (int i = 0; i < depth; ++i)
+                rebase(path[i]->next, objects[i], source + finish, delta);
+        }
+
+        // if edit changes structure around span, try enclosing one
+        for (int level = depth - 1; level >= 0; --level) {
+            size_t begin = begins[level];
+            char *end = source + finishes[level] + delta;
+            memcpy(source + begin, text + begin, end - (source + begin));
+
+            char closers[JSON_STACK_SIZE];
+            int count = 0;
+            for (int i = level; i >= 0 && !path[i]->next; --i)
+                closers[count++] = objects[i] ? '}' : ']';
+
+            JsonNode *member = path[level];
+            bool keyed = objects[level];
+            char *s = source + begin;
+            JsonValue key, o;
+            bool ok = true;
+            // parser must not write into parsed text after span
+            char next = *end;
+            *end = 0;
+            if (keyed) {
+                ok = jsonParse(s, &s, &key, allocator) == JSON_OK && key.getTag() == JSON_STRING;
+                while (jsonIsSpace(*s))
+                    ++s;
+                if (*s == ':')
                     ++s;
-                    break;
-                }
             }
-            if (!isdelim(*s)) {
-                *endptr = s;
-                return JSON_BAD_STRING;
+            ok = ok && s < end && jsonParse(s, &s, &o, allocator) == JSON_OK;
+            *end = next;
+            // value ending right at next token needs delimiter like anywhere
+            // else, full parse below reports what is wrong
+            if (s == end && !jsonIsDelim(next))
+                ok = false;
+            if (ok && sameClosers(s, end, closers, count, finishes[level] == oldSize)) {
+                if (keyed)
+                    member->key = key.toString();
+                member->value = o;
+                *endptr = end;
+                return JSON_OK;
             }
+        }
+    }
+
+    memcpy(source, text, size);
+    source[size] = 0;
+    allocator.deallocate();
+    return jsonParse(source, endptr, value, allocator);
+}
+
+#define JSON_PARALLEL_CHUNK_SIZE 65536
+
+struct JsonChunk {
+    char *begin;
+    char *end;
+    bool escaped;  // first character is escaped
+    bool quoted;   // chunk has odd number of unescaped quotes
+    int depth[2];  // bracket balance outside of strings, if chunk starts outside or inside of string
+    int lowest[2]; // lowest balance after closing bracket, the same way
+    bool inside;   // chunk starts inside of string
+    int level;     // bracket depth at chunk start
+    char *split;   // first top level element at or after chunk start
+    char *limit;   // first element of next run
+    JsonNode *head;
+    JsonNode *tail;
+    char *endptr;
+    int status;
+    JsonAllocator allocator;
+};
+
+static void indexChunk(JsonChunk &chunk, char *str) {
+    int backslashes = 0;
+    for (char *s = chunk.begin; s != str && s[-1] == '\\'; --s)
+        ++backslashes;
+    bool escaped = chunk.escaped = backslashes & 1;
+    int quoted = 0;
+    int depth[2] = {0, 0};
+    int lowest[2] = {INT_MAX, INT_MAX};
+    for (char *s = chunk.begin; s != chunk.end; ++s) {
+        if (escaped) {
+            escaped = false;
+            continue;
+        }
+        switch (*s) {
+        case '\\':
+            escaped = true;
             break;
-        case 't':
-            if (!(s[0] == 'r' && s[1] == 'u' && s[2] == 'e' && isdelim(s[3])))
-                return JSON_BAD_IDENTIFIER;
-            o = JsonValue(JSON_TRUE);
-            s += 3;
-            break;
-        case 'f':
-            if (!(s[0] == 'a' && s[1] == 'l' && s[2] == 's' && s[3] == 'e' && isdelim(s[4])))
-                return JSON_BAD_IDENTIFIER;
-            o = JsonValue(JSON_FALSE);
-            s += 4;
+        case '"':
+            quoted ^= 1;
             break;
-        case 'n':
-            if (!(s[0] == 'u' && s[1] == 'l' && s[2] == 'l' && isdelim(s[3])))
-                return JSON_BAD_IDENTIFIER;
-            o = JsonValue(JSON_NULL);
-            s += 3;
+        case '[':
+        case '{':
+            ++depth[quoted];
             break;
         case ']':
-            if (pos == -1)
-                return JSON_STACK_UNDERFLOW;
-            if (tags[pos] != JSON_ARRAY)
-                return JSON_MISMATCH_BRACKET;
-            o = listToValue(JSON_ARRAY, tails[pos--]);
-            break;
         case '}':
-            if (pos == -1)
-                return JSON_STACK_UNDERFLOW;
-            if (tags[pos] != JSON_OBJECT)
-                return JSON_MISMATCH_BRACKET;
-            if (keys[pos] != nullptr)
-                return JSON_UNEXPECTED_CHARACTER;
-            o = listToValue(JSON_OBJECT, tails[pos--]);
+            if (--depth[quoted] < lowest[quoted])
+                lowest[quoted] = depth[quoted];
             break;
-        case '[':
-            if (++pos == JSON_STACK_SIZE)
-                return JSON_STACK_OVERFLOW;
-            tails[pos] = nullptr;
-            tags[pos] = JSON_ARRAY;
-            keys[pos] = nullptr;
-            separator = true;
-            continue;
-        case '{':
-            if (++pos == JSON_STACK_SIZE)
-                return JSON_STACK_OVERFLOW;
-            tails[pos] = nullptr;
-            tags[pos] = JSON_OBJECT;
-            keys[pos] = nullptr;
-            separator = true;
-            continue;
-        case ':':
-            if (separator || keys[pos] == nullptr)
-                return JSON_UNEXPECTED_CHARACTER;
-            separator = true;
+        }
+    }
+    chunk.quoted = quoted;
+    chunk.depth[0] = depth[0];
+    chunk.depth[1] = depth[1];
+    chunk.lowest[0] = lowest[0];
+    chunk.lowest[1] = lowest[1];
+}
+
+// Looks for split only inside chunk, so whole index pass stays linear.
+static void splitChunk(JsonChunk &chunk, char *end) {
+    bool escaped = chunk.escaped;
+    bool inside = chunk.inside;
+    int level = chunk.level;
+    chunk.split = nullptr;
+    for (char *s = chunk.begin; s != end; ++s) {
+        if (escaped) {
+            escaped = false;
+        } else if (*s == '\\') {
+            escaped = true;
+        } else if (*s == '"') {
+            inside = !inside;
+        } else if (inside) {
             continue;
-        case ',':
-            if (separator || keys[pos] != nullptr)
-                return JSON_UNEXPECTED_CHARACTER;
+        } else if (*s == '[' || *s == '{') {
+            ++level;
+        } else if (*s == ']' || *s == '}') {
+            if (--level == 0)
+                return;
+        } else if (*s == ',' && level == 1) {
+            chunk.split = s + 1;
+            return;
+        }
+    }
+}
+
+// Element is one level below root, so it gets one level less of stack than
+// standalone value.
+struct JsonElementBuilder : JsonTreeBuilder {
+    JsonElementBuilder(JsonAllocator &allocator, JsonValue *value)
+        : JsonTreeBuilder(allocator, value) {
+    }
+    int startArray() {
+        return pos + 1 == JSON_STACK_SIZE - 1 ? JSON_STACK_OVERFLOW : JsonTreeBuilder::startArray();
+    }
+    int startObject() {
+        return pos + 1 == JSON_STACK_SIZE - 1 ? JSON_STACK_OVERFLOW : JsonTreeBuilder::startObject();
+    }
+};
+
+static int parseElement(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator) {
+    JsonElementBuilder builder(allocator, value);
+    return jsonParseEvents(s, endptr, builder);
+}
+
+static void parseChunk(JsonChunk &chunk, JsonTag tag) {
+    char *s = chunk.split;
+    char *limit = chunk.limit;
+    bool separator = true;
+    while (limit == nullptr || s < limit) {
+        while (jsonIsSpace(*s))
+            ++s;
+        chunk.endptr = s;
+        if (*s == ',') {
+            if (separator) {
+                chunk.status = JSON_UNEXPECTED_CHARACTER;
+                return;
+            }
             separator = true;
+            ++s;
             continue;
-        case '\0':
-            continue;
-        default:
-            return JSON_UNEXPECTED_CHARACTER;
         }
-
+        if (*s == ']' || *s == '}' || !*s) {
+            // only last run meets closing bracket of root
+            if (limit)
+                chunk.status = JSON_UNEXPECTED_CHARACTER;
+            else if (!*s)
+                chunk.status = JSON_BREAKING_BAD;
+            else if (*s != (tag == JSON_ARRAY ? ']' : '}'))
+                chunk.status = JSON_MISMATCH_BRACKET;
+            else
+                chunk.endptr = s + 1;
+            return;
+        }
+        JsonNode *node;
+        JsonValue key;
+        if (tag == JSON_OBJECT) {
+            // tokenizer does not descend into container in place of key
+            if (*s == '[' || *s == '{') {
+                chunk.status = JSON_UNQUOTED_KEY;
+                return;
+            }
+            if ((chunk.status = jsonParse(s, &chunk.endptr, &key, chunk.allocator)) != JSON_OK)
+                return;
+            if (key.getTag() != JSON_STRING) {
+                chunk.endptr = s;
+                chunk.status = JSON_UNQUOTED_KEY;
+                return;
+            }
+            s = chunk.endptr;
+            while (jsonIsSpace(*s))
+                ++s;
+            if (*s == ':')
+                ++s;
+            // closing bracket in place of value ends object, as tokenizer
+            // sees it
+            char *value = s;
+            while (jsonIsSpace(*value))
+                ++value;
+            if (*value == ']' || *value == '}') {
+                chunk.endptr = value;
+                chunk.status = *value == '}' ? JSON_UNEXPECTED_CHARACTER : JSON_MISMATCH_BRACKET;
+                return;
+            }
+            node = (JsonNode *)chunk.allocator.allocate(sizeof(JsonNode));
+        } else {
+            node = (JsonNode *)chunk.allocator.allocate(sizeof(JsonNode) - sizeof(char *));
+        }
+        if (node == nullptr) {
+            chunk.status = JSON_ALLOCATION_FAILURE;
+            return;
+        }
+        if (tag == JSON_OBJECT)
+            node->key = key.toString();
+        if ((chunk.status = parseElement(s, &chunk.endptr, &node->value, chunk.allocator)) != JSON_OK)
+            return;
+        s = chunk.endptr;
+        node->next = nullptr;
+        if (chunk.tail)
+            chunk.tail->next = node;
+        else
+            chunk.head = node;
+        chunk.tail = node;
         separator = false;
+    }
+    if (s != limit) {
+        // element ran over next split point, so index was wrong about text
+        chunk.endptr = limit;
+        chunk.status = JSON_UNEXPECTED_CHARACTER;
+    }
+}
 
-        if (pos == -1) {
-            *endptr = s;
-            *value = o;
-            return JSON_OK;
+template <typename Job>
+static void forEachChunk(std::vector<JsonChunk> &chunks, Job job) {
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunks.size(); ++i)
+        workers.emplace_back(job, std::ref(chunks[i]));
+    job(chunks[0]);
+    for (auto &t : workers)
+        t.join();
+}
+
+int jsonParseParallel(char *s, size_t size, char **endptr, JsonValue *value, JsonAllocator &allocator, unsigned threads) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads > size / JSON_PARALLEL_CHUNK_SIZE)
+        threads = size / JSON_PARALLEL_CHUNK_SIZE;
+
+    char *root = s;
+    while (jsonIsSpace(*root))
+        ++root;
+    if (threads < 2 || (*root != '[' && *root != '{'))
+        return jsonParse(s, endptr, value, allocator);
+    JsonTag tag = *root == '[' ? JSON_ARRAY : JSON_OBJECT;
+
+    std::vector<JsonChunk> chunks(threads);
+    for (unsigned i = 0; i < threads; ++i) {
+        chunks[i].begin = s + size * i / threads;
+        chunks[i].end = s + size * (i + 1) / threads;
+        chunks[i].head = chunks[i].tail = nullptr;
+        chunks[i].status = JSON_OK;
+        if (allocator.zonePool())
+            chunks[i].allocator = JsonAllocator(*allocator.zonePool());
+    }
+
+    // quote parity and bracket balance of every chunk, then prefix scan
+    // gives string state and depth at every chunk start
+    forEachChunk(chunks, [s](JsonChunk &chunk) {
+        indexChunk(chunk, s);
+    });
+    chunks[0].inside = false;
+    chunks[0].level = 0;
+    for (unsigned i = 1; i < threads; ++i) {
+        JsonChunk &prev = chunks[i - 1];
+        // root closes before last chunk, text after it is not elements
+        if (prev.lowest[prev.inside] <= -prev.level)
+            return jsonParse(s, endptr, value, allocator);
+        chunks[i].inside = prev.inside != prev.quoted;
+        chunks[i].level = prev.level + prev.depth[prev.inside];
+    }
+
+    // first top level comma inside every chunk splits elements into runs,
+    // chunks without one have no run and previous run goes over them
+    forEachChunk(chunks, [s, root](JsonChunk &chunk) {
+        if (chunk.begin == s)
+            chunk.split = root + 1;
+        else
+            splitChunk(chunk, chunk.end);
+    });
+    char *limit = nullptr;
+    size_t longest = 0;
+    for (unsigned i = threads; i-- > 0;) {
+        chunks[i].limit = limit;
+        if (chunks[i].split) {
+            size_t run = (limit ? limit : s + size) - chunks[i].split;
+            if (run > longest)
+                longest = run;
+            limit = chunks[i].split;
         }
+    }
+    // with few top level elements one run does most of work, and text is
+    // not touched yet
+    if (longest > size / 2)
+        return jsonParse(s, endptr, value, allocator);
 
-        if (tags[pos] == JSON_OBJECT) {
-            if (!keys[pos]) {
-                if (o.getTag() != JSON_STRING)
-                    return JSON_UNQUOTED_KEY;
-                keys[pos] = o.toString();
-                continue;
-            }
-            if ((node = (JsonNode *) allocator.allocate(sizeof(JsonNode))) == nullptr)
-                return JSON_ALLOCATION_FAILURE;
-            tails[pos] = insertAfter(tails[pos], node);
-            tails[pos]->key = keys[pos];
-            keys[pos] = nullptr;
-        } else {
-            if ((node = (JsonNode *) allocator.allocate(sizeof(JsonNode) - sizeof(char *))) == nullptr)
-                return JSON_ALLOCATION_FAILURE;
-            tails[pos] = insertAfter(tails[pos], node);
+    forEachChunk(chunks, [tag](JsonChunk &chunk) {
+        if (chunk.split)
+            parseChunk(chunk, tag);
+    });
+
+    JsonNode *head = nullptr, *tail = nullptr;
+    for (auto &chunk : chunks) {
+        if (!chunk.split)
+            continue;
+        if (chunk.status != JSON_OK) {
+            *endptr = chunk.endptr;
+            return chunk.status;
         }
-        tails[pos]->value = o;
+        allocator.merge(chunk.allocator);
+        if (!chunk.head)
+            continue;
+        if (tail)
+            tail->next = chunk.head;
+        else
+            head = chunk.head;
+        tail = chunk.tail;
+        *endptr = chunk.endptr;
+    }
+    *value = JsonValue(tag, head);
+    return JSON_OK;
+}
+
+struct JsonCompactSize {
+    JsonOrder order;
+    size_t nodes;
+    size_t strings;
+    bool root;
+
+    bool enter(JsonValue o, const char *key) {
+        if (!root)
+            nodes += (key || order == JSON_BREADTH_FIRST) ? sizeof(JsonNode) : sizeof(JsonNode) - sizeof(char *);
+        if (key)
+            strings += strlen(key) + 1;
+        if (o.getTag() == JSON_STRING)
+            strings += strlen(o.toString()) + 1;
+        root = false;
+        return true;
     }
-    return JSON_BREAKING_BAD;
+    void leave(JsonValue) {
+    }
+};
+
+struct JsonCompactCopy {
+    char *nodes;
+    char *strings;
+    JsonValue *result;
+    JsonNode *tails[JSON_STACK_SIZE];
+    JsonNode *holders[JSON_STACK_SIZE];
+    JsonNode *holder;
+    int pos;
+
+    char *copy(const char *s) {
+        size_t n = strlen(s) + 1;
+        char *p = (char *)memcpy(strings, s, n);
+        strings += n;
+        return p;
+    }
+    JsonValue copyList(JsonValue o) {
+        // breadth first: whole list at once, full sized nodes
+        JsonNode *head = (JsonNode *)nodes, *node = nullptr;
+        for (auto i : o) {
+            node = (JsonNode *)nodes;
+            nodes += sizeof(JsonNode);
+            node->next = (JsonNode *)nodes;
+            node->key = o.getTag() == JSON_OBJECT ? copy(i->key) : nullptr;
+            node->value = i->value.getTag() == JSON_STRING ? JsonValue(JSON_STRING, copy(i->value.toString())) : i->value;
+        }
+        if (!node)
+            return JsonValue(o.getTag(), nullptr);
+        node->next = nullptr;
+        return JsonValue(o.getTag(), head);
+    }
+    bool enter(JsonValue o, const char *key) {
+        JsonNode *node = nullptr;
+        if (pos != -1) {
+            node = (JsonNode *)nodes;
+            nodes += key ? sizeof(JsonNode) : sizeof(JsonNode) - sizeof(char *);
+            tails[pos] = insertAfter(tails[pos], node);
+            if (key)
+                node->key = copy(key);
+        }
+        switch (o.getTag()) {
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            tails[++pos] = nullptr;
+            holders[pos] = node;
+            return true;
+        case JSON_STRING:
+            o = JsonValue(JSON_STRING, copy(o.toString()));
+            break;
+        default:
+            break;
+        }
+        if (node)
+            node->value = o;
+        else
+            *result = o;
+        return true;
+    }
+    void leave(JsonValue o) {
+        JsonValue list = listToValue(o.getTag(), tails[pos]);
+        if (holders[pos])
+            holders[pos]->value = list;
+        else
+            *result = list;
+        --pos;
+    }
+};
+
+int jsonCompact(JsonValue value, JsonValue *result, JsonAllocator &allocator, JsonOrder order) {
+    JsonCompactSize size{order, 0, 0, true};
+    int status = jsonWalk(value, size);
+    if (status != JSON_OK)
+        return status;
+
+    char *block = nullptr;
+    if (size.nodes + size.strings) {
+        if ((block = (char *)allocator.allocate(size.nodes + size.strings)) == nullptr)
+            return JSON_ALLOCATION_FAILURE;
+    }
+
+    JsonCompactCopy copy;
+    copy.nodes = block;
+    copy.strings = block + size.nodes;
+    copy.result = result;
+    copy.pos = -1;
+
+    if (order == JSON_DEPTH_FIRST)
+        return jsonWalk(value, copy);
+
+    // Cheney style: nodes already copied serve as queue of lists to copy
+    switch (value.getTag()) {
+    case JSON_ARRAY:
+    case JSON_OBJECT:
+        *result = copy.copyList(value);
+        break;
+    case JSON_STRING:
+        *result = JsonValue(JSON_STRING, copy.copy(value.toString()));
+        break;
+    default:
+        *result = value;
+        break;
+    }
+    for (JsonNode *scan = (JsonNode *)block; scan != (JsonNode *)copy.nodes; ++scan) {
+        JsonTag tag = scan->value.getTag();
+        if (tag == JSON_ARRAY || tag == JSON_OBJECT)
+            scan->value = copy.copyList(scan->value);
+    }
+    return JSON_OK;
+}
+
+static inline uint64_t hashString(const char *s) {
+    // FNV-1a
+    uint64_t h = 0xCBF29CE484222325ULL;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 0x100000001B3ULL;
+    return h;
+}
+
+#define JSON_INDEX_INLINE_SLOTS 16
+
+struct JsonKeySlot {
+    JsonNode *node;
+    bool matched;
+};
+
+// Temporary open addressing index of object members by key. Every member gets
+// own slot, so duplicate keys sit in one probe run and each can be matched
+// once. Small objects stay in inline slots.
+struct JsonKeyIndex {
+    JsonKeySlot *slots;
+    size_t mask;
+    JsonKeySlot inlineSlots[JSON_INDEX_INLINE_SLOTS];
+
+    JsonKeyIndex() : slots(inlineSlots), mask(0) {
+    }
+    JsonKeyIndex(const JsonKeyIndex &) = delete;
+    JsonKeyIndex &operator=(const JsonKeyIndex &) = delete;
+    ~JsonKeyIndex() {
+        if (slots != inlineSlots)
+            free(slots);
+    }
+    bool build(JsonNode *first, size_t count) {
+        size_t capacity = JSON_INDEX_INLINE_SLOTS;
+        while (capacity < count * 2)
+            capacity *= 2;
+        if (capacity > JSON_INDEX_INLINE_SLOTS && (slots = (JsonKeySlot *)malloc(capacity * sizeof(JsonKeySlot))) == nullptr)
+            return false;
+        memset(slots, 0, capacity * sizeof(JsonKeySlot));
+        mask = capacity - 1;
+        for (auto i = first; i; i = i->next) {
+            size_t h = hashString(i->key) & mask;
+            while (slots[h].node)
+                h = (h + 1) & mask;
+            slots[h].node = i;
+        }
+        return true;
+    }
+    // next unmatched slot with key after given one, first when after is null
+    JsonKeySlot *find(const char *key, JsonKeySlot *after = nullptr) {
+        size_t h = after ? (after - slots + 1) & mask : hashString(key) & mask;
+        for (; slots[h].node; h = (h + 1) & mask) {
+            if (!slots[h].matched && !strcmp(slots[h].node->key, key))
+                return &slots[h];
+        }
+        return nullptr;
+    }
+    // slot of indexed member
+    JsonKeySlot *locate(JsonNode *node) {
+        size_t h = hashString(node->key) & mask;
+        while (slots[h].node != node)
+            h = (h + 1) & mask;
+        return &slots[h];
+    }
+};
+
+static size_t countMembers(JsonValue o) {
+    size_t count = 0;
+    for (auto i = o.toNode(); i; i = i->next)
+        ++count;
+    return count;
+}
+
+static bool hasKey(JsonNode *list, const char *key) {
+    for (auto i = list; i; i = i->next) {
+        if (!strcmp(i->key, key))
+            return true;
+    }
+    return false;
+}
+
+// members of list with same key as node and equal value
+static size_t countEqual(JsonNode *list, JsonNode *node) {
+    size_t count = 0;
+    for (auto i = list; i; i = i->next) {
+        if (!strcmp(i->key, node->key) && jsonEqual(i->value, node->value))
+            ++count;
+    }
+    return count;
+}
+
+bool jsonEqual(JsonValue a, JsonValue b) {
+    if (a.ival == b.ival)
+        return true;
+    JsonTag tag = a.getTag();
+    if (tag != b.getTag())
+        return false;
+    switch (tag) {
+    case JSON_NUMBER:
+        return a.toNumber() == b.toNumber();
+    case JSON_STRING:
+        return !strcmp(a.toString(), b.toString());
+    case JSON_ARRAY: {
+        JsonNode *i = a.toNode(), *j = b.toNode();
+        for (; i && j; i = i->next, j = j->next) {
+            if (!jsonEqual(i->value, j->value))
+                return false;
+        }
+        return !i && !j;
+    }
+    case JSON_OBJECT: {
+        size_t count = countMembers(a);
+        if (count != countMembers(b))
+            return false;
+        // members in same order is common case, so try lockstep walk first
+        JsonNode *i = a.toNode(), *j = b.toNode();
+        for (; i && !strcmp(i->key, j->key); i = i->next, j = j->next) {
+            if (jsonEqual(i->value, j->value))
+                continue;
+            // with key repeated later, other member may be pair of either
+            if (!hasKey(i->next, i->key) && !hasKey(j->next, j->key))
+                return false;
+            break;
+        }
+        if (!i)
+            return true;
+        // rest of members must pair up one to one, duplicate keys included
+        JsonKeyIndex index;
+        if (!index.build(j, count)) {
+            // no memory for index, compare how often each member occurs
+            for (JsonNode *k = i; k; k = k->next) {
+                if (countEqual(i, k) != countEqual(j, k))
+                    return false;
+            }
+            return true;
+        }
+        for (; i; i = i->next) {
+            JsonKeySlot *slot = index.find(i->key);
+            while (slot && !jsonEqual(i->value, slot->node->value))
+                slot = index.find(i->key, slot);
+            if (!slot)
+                return false;
+            slot->matched = true;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+struct JsonDiffer {
+    JsonAllocator &allocator;
+    JsonNode *tail;
+    char *path;
+    size_t size;
+    size_t capacity;
+
+    JsonDiffer(JsonAllocator &allocator)
+        : allocator(allocator), tail(nullptr), path(nullptr), size(0), capacity(0) {
+    }
+    ~JsonDiffer() {
+        free(path);
+    }
+    bool reserve(size_t n) {
+        if (size + n <= capacity)
+            return true;
+        size_t grown = capacity ? capacity * 2 : 256;
+        while (grown < size + n)
+            grown *= 2;
+        char *p = (char *)realloc(path, grown);
+        if (!p)
+            return false;
+        path = p;
+        capacity = grown;
+        return true;
+    }
+    // JSON Pointer escapes '~' as "~0" and '/' as "~1"
+    bool pushKey(const char *key) {
+        if (!reserve(strlen(key) * 2 + 1))
+            return false;
+        path[size++] = '/';
+        for (; *key; ++key) {
+            if (*key == '~' || *key == '/') {
+                path[size++] = '~';
+                path[size++] = *key == '~' ? '0' : '1';
+            } else {
+                path[size++] = *key;
+            }
+        }
+        return true;
+    }
+    bool pushIndex(size_t index) {
+        char buffer[24];
+        char *s = buffer + sizeof(buffer);
+        do
+            *--s = '0' + index % 10;
+        while (index /= 10);
+        *--s = '/';
+        size_t n = buffer + sizeof(buffer) - s;
+        if (!reserve(n))
+            return false;
+        memcpy(path + size, s, n);
+        size += n;
+        return true;
+    }
+    int emit(const char *op, JsonValue value, bool hasValue) {
+        JsonNode *members = (JsonNode *)allocator.allocate(sizeof(JsonNode) * 3);
+        char *pointer = (char *)allocator.allocate(size + 1);
+        JsonNode *node = (JsonNode *)allocator.allocate(sizeof(JsonNode) - sizeof(char *));
+        if (!members || !pointer || !node)
+            return JSON_ALLOCATION_FAILURE;
+        if (size)
+            memcpy(pointer, path, size);
+        pointer[size] = 0;
+        members[0].key = (char *)"op";
+        members[0].value = JsonValue(JSON_STRING, (void *)op);
+        members[0].next = &members[1];
+        members[1].key = (char *)"path";
+        members[1].value = JsonValue(JSON_STRING, pointer);
+        members[1].next = hasValue ? &members[2] : nullptr;
+        members[2].key = (char *)"value";
+        members[2].value = value;
+        members[2].next = nullptr;
+        node->value = JsonValue(JSON_OBJECT, members);
+        tail = insertAfter(tail, node);
+        return JSON_OK;
+    }
+    int diffArrays(JsonValue from, JsonValue to) {
+        size_t base = size;
+        size_t index = 0;
+        JsonNode *i = from.toNode(), *j = to.toNode();
+        int status;
+        for (; i && j; i = i->next, j = j->next, ++index) {
+            if (!pushIndex(index))
+                return JSON_ALLOCATION_FAILURE;
+            if ((status = diff(i->value, j->value)) != JSON_OK)
+                return status;
+            size = base;
+        }
+        // removals go from end, so earlier indices stay valid
+        size_t count = index;
+        for (; i; i = i->next)
+            ++count;
+        while (count-- > index) {
+            if (!pushIndex(count) || emit("remove", JsonValue(), false) != JSON_OK)
+                return JSON_ALLOCATION_FAILURE;
+            size = base;
+        }
+        for (; j; j = j->next, ++index) {
+            if (!pushIndex(index) || emit("add", j->value, true) != JSON_OK)
+                return JSON_ALLOCATION_FAILURE;
+            size = base;
+        }
+        return JSON_OK;
+    }
+    int diffObjects(JsonValue from, JsonValue to) {
+        size_t base = size;
+        JsonKeyIndex index;
+        int status;
+        // same keys in same order need no index
+        JsonNode *i = from.toNode(), *j = to.toNode();
+        while (i && j && !strcmp(i->key, j->key))
+            i = i->next, j = j->next;
+        if (!i && !j) {
+            for (i = from.toNode(), j = to.toNode(); i; i = i->next, j = j->next) {
+                if (!pushKey(i->key))
+                    return JSON_ALLOCATION_FAILURE;
+                if ((status = diff(i->value, j->value)) != JSON_OK)
+                    return status;
+                size = base;
+            }
+            return JSON_OK;
+        }
+        if (!index.build(to.toNode(), countMembers(to)))
+            return JSON_ALLOCATION_FAILURE;
+        // every member of to pairs with at most one of from, extra
+        // duplicates are removed or added
+        for (auto i : from) {
+            JsonKeySlot *slot = index.find(i->key);
+            if (!pushKey(i->key))
+                return JSON_ALLOCATION_FAILURE;
+            if (slot) {
+                slot->matched = true;
+                status = diff(i->value, slot->node->value);
+            } else {
+                status = emit("remove", JsonValue(), false);
+            }
+            if (status != JSON_OK)
+                return status;
+            size = base;
+        }
+        for (auto j : to) {
+            if (index.locate(j)->matched)
+                continue;
+            if (!pushKey(j->key) || emit("add", j->value, true) != JSON_OK)
+                return JSON_ALLOCATION_FAILURE;
+            size = base;
+        }
+        return JSON_OK;
+    }
+    int diff(JsonValue from, JsonValue to) {
+        JsonTag tag = from.getTag();
+        if (tag == to.getTag()) {
+            if (tag == JSON_ARRAY)
+                return diffArrays(from, to);
+            if (tag == JSON_OBJECT)
+                return diffObjects(from, to);
+            if (jsonEqual(from, to))
+                return JSON_OK;
+        }
+        return emit("replace", to, true);
+    }
+};
+
+int jsonDiff(JsonValue from, JsonValue to, JsonValue *patch, JsonAllocator &allocator) {
+    JsonDiffer differ(allocator);
+    int status = differ.diff(from, to);
+    *patch = listToValue(JSON_ARRAY, differ.tail);
+    return status;
+}
+
+#define JSON_HASH_SEED_LOW 0x9E3779B97F4A7C15ULL
+#define JSON_HASH_SEED_HIGH 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline JsonHash hashWord(uint64_t x, uint64_t salt) {
+    return JsonHash{fmix64(x ^ salt ^ JSON_HASH_SEED_LOW), fmix64(x ^ salt ^ JSON_HASH_SEED_HIGH)};
+}
+
+static JsonHash hashBytes(const char *s, uint64_t salt) {
+    size_t size = strlen(s);
+    uint64_t low = JSON_HASH_SEED_LOW ^ salt ^ size, high = JSON_HASH_SEED_HIGH ^ salt ^ size;
+    for (; size >= 8; s += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, s, 8);
+        low = rotl64(low ^ w, 29) * 0x87C37B91114253D5ULL;
+        high = rotl64(high ^ w, 31) * 0x4CF5AD432745937FULL;
+    }
+    uint64_t w = 0;
+    memcpy(&w, s, size);
+    return JsonHash{fmix64(low ^ w), fmix64(high ^ rotl64(w, 32))};
+}
+
+struct JsonHashCache::Entry {
+    JsonNode *node;
+    JsonHash hash;
+};
+
+bool JsonHashCache::find(JsonNode *node, JsonHash *hash) const {
+    if (!entries)
+        return false;
+    for (size_t i = fmix64((uintptr_t)node) & mask; entries[i].node; i = (i + 1) & mask) {
+        if (entries[i].node == node) {
+            *hash = entries[i].hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool JsonHashCache::insert(JsonNode *node, JsonHash hash) {
+    if (count * 2 >= mask) {
+        // old table stays in allocator until it is deallocated
+        size_t capacity = entries ? (mask + 1) * 2 : 64;
+        Entry *table = (Entry *)allocator.allocate(capacity * sizeof(Entry));
+        if (!table)
+            return false;
+        memset(table, 0, capacity * sizeof(Entry));
+        Entry *old = entries;
+        size_t size = entries ? mask + 1 : 0;
+        entries = table;
+        mask = capacity - 1;
+        count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            if (old[i].node)
+                insert(old[i].node, old[i].hash);
+        }
+    }
+    size_t i = fmix64((uintptr_t)node) & mask;
+    while (entries[i].node && entries[i].node != node)
+        i = (i + 1) & mask;
+    if (!entries[i].node)
+        ++count;
+    entries[i].node = node;
+    entries[i].hash = hash;
+    return true;
+}
+
+// Arrays fold element hashes in order, objects add up hashes of key and value
+// pairs, so member order does not matter.
+struct JsonHasher {
+    struct Frame {
+        JsonHash hash;
+        uint64_t count;
+        const char *key;
+    };
+    JsonHashCache *cache;
+    JsonHash result;
+    Frame frames[JSON_STACK_SIZE];
+    int pos;
+    int status;
+
+    void add(JsonHash h, const char *key) {
+        if (pos == -1) {
+            result = h;
+            return;
+        }
+        Frame &frame = frames[pos];
+        if (key) {
+            JsonHash k = hashBytes(key, 0);
+            frame.hash.low += fmix64(k.low ^ rotl64(h.low, 17));
+            frame.hash.high += fmix64(k.high ^ rotl64(h.high, 43));
+        } else {
+            frame.hash.low = rotl64(frame.hash.low ^ h.low, 27) * 0x87C37B91114253D5ULL;
+            frame.hash.high = rotl64(frame.hash.high ^ h.high, 33) * 0x4CF5AD432745937FULL;
+        }
+        ++frame.count;
+    }
+    bool enter(JsonValue value, const char *key) {
+        JsonHash h;
+        switch (value.getTag()) {
+        case JSON_NUMBER: {
+            // -0 equals 0
+            double x = value.toNumber();
+            h = hashWord(x == 0 ? 0 : value.ival, JSON_NUMBER);
+            break;
+        }
+        case JSON_STRING:
+            h = hashBytes(value.toString(), JSON_STRING);
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            if (!value.toNode()) {
+                h = hashWord(0, value.getTag());
+                break;
+            }
+            if (cache && cache->find(value.toNode(), &h))
+                break;
+            if (pos + 1 == JSON_STACK_SIZE) {
+                status = JSON_STACK_OVERFLOW;
+                return false;
+            }
+            ++pos;
+            frames[pos] = Frame{JsonHash{0, 0}, 0, key};
+            return true;
+        default:
+            h = hashWord(0, value.getTag());
+            break;
+        }
+        add(h, key);
+        return false;
+    }
+    void leave(JsonValue value) {
+        Frame &frame = frames[pos--];
+        JsonHash h = hashWord(frame.hash.low ^ rotl64(frame.hash.high, 32), value.getTag() ^ (frame.count << 4));
+        h.high ^= fmix64(frame.hash.high + frame.count);
+        if (cache && !cache->insert(value.toNode(), h))
+            status = JSON_ALLOCATION_FAILURE;
+        add(h, frame.key);
+    }
+};
+
+int jsonHash(JsonValue value, JsonHash *hash, JsonHashCache *cache) {
+    JsonHasher hasher;
+    hasher.cache = cache;
+    hasher.pos = -1;
+    hasher.status = JSON_OK;
+    int status = jsonWalk(value, hasher);
+    if (status == JSON_OK)
+        status = hasher.status;
+    *hash = hasher.result;
+    return status;
+}
+
+bool jsonEqual(JsonValue a, JsonValue b, JsonHashCache &cache) {
+    if (a.ival == b.ival)
+        return true;
+    JsonTag tag = a.getTag();
+    if (tag != b.getTag() || (tag != JSON_ARRAY && tag != JSON_OBJECT))
+        return jsonEqual(a, b);
+    JsonHash x, y;
+    if (jsonHash(a, &x, &cache) != JSON_OK || jsonHash(b, &y, &cache) != JSON_OK)
+        return jsonEqual(a, b);
+    return x == y;
+}
+
+void JsonTape::deallocate() {
+    free(buffer);
+    buffer = nullptr;
+    length = 0;
+}
+
+static inline JsonValue tapeEntry(JsonTag tag, uint64_t payload) {
+    return JsonValue(tag, (void *)(uintptr_t)payload);
+}
+
+struct JsonTapeWriter {
+    JsonValue *entries;
+    size_t count;
+    size_t capacity;
+    char *strings;
+    size_t used;
+    size_t reserved;
+    size_t keys;
+    size_t starts[JSON_STACK_SIZE];
+    int pos;
+
+    JsonTapeWriter()
+        : entries(nullptr), count(JSON_TAPE_HEADER_SIZE), capacity(0), strings(nullptr), used(0), reserved(0), keys(0), pos(-1) {
+    }
+    ~JsonTapeWriter() {
+        free(entries);
+        free(strings);
+    }
+    bool push(JsonValue x) {
+        if (count >= capacity) {
+            size_t n = capacity < 256 ? 256 : capacity * 2;
+            JsonValue *p = (JsonValue *)realloc(entries, n * sizeof(JsonValue));
+            if (p == nullptr)
+                return false;
+            entries = p;
+            capacity = n;
+        }
+        entries[count++] = x;
+        return true;
+    }
+    bool append(const char *s, size_t n) {
+        if (used + n + 1 > reserved) {
+            size_t size = reserved < 4096 ? 4096 : reserved * 2;
+            while (size < used + n + 1)
+                size *= 2;
+            char *p = (char *)realloc(strings, size);
+            if (p == nullptr)
+                return false;
+            strings = p;
+            reserved = size;
+        }
+        if (!push(tapeEntry(JSON_STRING, used)))
+            return false;
+        memcpy(strings + used, s, n);
+        strings[used + n] = 0;
+        used += n + 1;
+        return true;
+    }
+    bool finish(JsonTape &tape) {
+        size_t size = count * sizeof(JsonValue) + used;
+        char *p = (char *)realloc(entries, size);
+        if (p == nullptr)
+            return false;
+        entries = nullptr;
+        // every value but root becomes a node, members also need key pointer
+        size_t values = count - JSON_TAPE_HEADER_SIZE - 1 - keys;
+        ((uint64_t *)p)[0] = JSON_TAPE_MAGIC;
+        ((uint64_t *)p)[1] = count - JSON_TAPE_HEADER_SIZE;
+        ((uint64_t *)p)[2] = used;
+        ((uint64_t *)p)[3] = values * (sizeof(JsonNode) - sizeof(char *)) + keys * sizeof(char *);
+        if (used)
+            memcpy(p + count * sizeof(JsonValue), strings, used);
+        tape.deallocate();
+        tape.buffer = p;
+        tape.length = size;
+        return true;
+    }
+
+    int start(JsonTag tag) {
+        starts[++pos] = count;
+        return push(JsonValue(tag)) ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+    int end(JsonTag tag) {
+        size_t index = starts[pos--];
+        entries[index] = tapeEntry(tag, count - index - 1);
+        return JSON_OK;
+    }
+    int startArray() {
+        return start(JSON_ARRAY);
+    }
+    int startObject() {
+        return start(JSON_OBJECT);
+    }
+    int endArray() {
+        return end(JSON_ARRAY);
+    }
+    int endObject() {
+        return end(JSON_OBJECT);
+    }
+    int key(char *s, size_t n) {
+        ++keys;
+        return append(s, n) ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+    int string(char *s, size_t n) {
+        return append(s, n) ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+    int number(double x) {
+        return push(JsonValue(x)) ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+    int boolean(bool x) {
+        return push(JsonValue(x ? JSON_TRUE : JSON_FALSE)) ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+    int null() {
+        return push(JsonValue(JSON_NULL)) ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+};
+
+int jsonParse(char *s, char **endptr, JsonTape &tape) {
+    JsonTapeWriter writer;
+    int status = jsonParseEvents(s, endptr, writer);
+    if (status == JSON_OK && !writer.finish(tape))
+        return JSON_ALLOCATION_FAILURE;
+    return status;
+}
+
+static bool encodeValue(JsonTapeWriter &writer, JsonValue o) {
+    switch (o.getTag()) {
+    case JSON_STRING:
+        return writer.append(o.toString(), strlen(o.toString()));
+    case JSON_ARRAY:
+    case JSON_OBJECT: {
+        size_t index = writer.count;
+        if (!writer.push(o))
+            return false;
+        for (auto i : o) {
+            if (o.getTag() == JSON_OBJECT) {
+                ++writer.keys;
+                if (!writer.append(i->key, strlen(i->key)))
+                    return false;
+            }
+            if (!encodeValue(writer, i->value))
+                return false;
+        }
+        writer.entries[index] = tapeEntry(o.getTag(), writer.count - index - 1);
+        return true;
+    }
+    default:
+        return writer.push(o);
+    }
+}
+
+int jsonEncode(JsonValue value, JsonTape &tape) {
+    JsonTapeWriter writer;
+    if (!encodeValue(writer, value) || !writer.finish(tape))
+        return JSON_ALLOCATION_FAILURE;
+    return JSON_OK;
+}
+
+int jsonTapeRoot(const void *data, size_t size, JsonTapeValue *value) {
+    const uint64_t *header = (const uint64_t *)data;
+    if (size < (JSON_TAPE_HEADER_SIZE + 1) * sizeof(JsonValue) || header[0] != JSON_TAPE_MAGIC)
+        return JSON_BAD_TAPE;
+    size_t count = header[1];
+    if (count == 0 || count > size / sizeof(JsonValue) - JSON_TAPE_HEADER_SIZE || header[2] != size - (JSON_TAPE_HEADER_SIZE + count) * sizeof(JsonValue))
+        return JSON_BAD_TAPE;
+    value->p = (const JsonValue *)data + JSON_TAPE_HEADER_SIZE;
+    value->strings = (const char *)(value->p + count);
+    return JSON_OK;
+}
+
+static int decodeValue(const JsonValue *&p, const JsonValue *end, char *strings, size_t size, int depth, JsonValue *value, char *&nodes, char *limit) {
+    JsonValue o = *p++;
+    switch (o.getTag()) {
+    case JSON_NUMBER:
+    case JSON_TRUE:
+    case JSON_FALSE:
+    case JSON_NULL:
+        *value = o;
+        return JSON_OK;
+    case JSON_STRING:
+        if (o.getPayload() >= size)
+            return JSON_BAD_TAPE;
+        *value = JsonValue(JSON_STRING, strings + o.getPayload());
+        return JSON_OK;
+    case JSON_ARRAY:
+    case JSON_OBJECT:
+        break;
+    default:
+        return JSON_BAD_TAPE;
+    }
+
+    if (o.getPayload() > (uint64_t)(end - p))
+        return JSON_BAD_TAPE;
+    if (depth == JSON_STACK_SIZE)
+        return JSON_STACK_OVERFLOW;
+
+    JsonTag tag = o.getTag();
+    const JsonValue *last = p + o.getPayload();
+    JsonNode *head = nullptr, *tail = nullptr;
+    while (p != last) {
+        JsonNode *node = (JsonNode *)nodes;
+        if (tag == JSON_OBJECT) {
+            JsonValue key;
+            if (limit - nodes < (ptrdiff_t)sizeof(JsonNode))
+                return JSON_BAD_TAPE;
+            if (p->getTag() != JSON_STRING || decodeValue(p, last, strings, size, depth, &key, nodes, limit) != JSON_OK || p == last)
+                return JSON_BAD_TAPE;
+            node->key = key.toString();
+            nodes += sizeof(JsonNode);
+        } else {
+            if (limit - nodes < (ptrdiff_t)(sizeof(JsonNode) - sizeof(char *)))
+                return JSON_BAD_TAPE;
+            nodes += sizeof(JsonNode) - sizeof(char *);
+        }
+        int status = decodeValue(p, last, strings, size, depth + 1, &node->value, nodes, limit);
+        if (status != JSON_OK)
+            return status;
+        node->next = nullptr;
+        if (tail)
+            tail->next = node;
+        else
+            head = node;
+        tail = node;
+    }
+    *value = JsonValue(tag, head);
+    return JSON_OK;
+}
+
+int jsonDecode(const void *data, size_t size, JsonValue *value, JsonAllocator &allocator) {
+    JsonTapeValue root;
+    if (jsonTapeRoot(data, size, &root) != JSON_OK)
+        return JSON_BAD_TAPE;
+    const uint64_t *header = (const uint64_t *)data;
+    size_t count = header[1];
+    size_t strings = header[2];
+    size_t bytes = header[3];
+    if (strings && root.strings[strings - 1] != 0)
+        return JSON_BAD_TAPE;
+    if (bytes > (count - 1) * sizeof(JsonNode))
+        return JSON_BAD_TAPE;
+
+    // Encoder records exact size of all nodes, so they are carved from
+    // a single block instead of going through allocate() per node.
+    char *nodes = (char *)allocator.allocate(bytes);
+    if (bytes && nodes == nullptr)
+        return JSON_ALLOCATION_FAILURE;
+
+    const JsonValue *p = root.p;
+    const JsonValue *end = p + count;
+    int status = decodeValue(p, end, (char *)root.strings, strings, 0, value, nodes, nodes + bytes);
+    if (status == JSON_OK && p != end)
+        return JSON_BAD_TAPE;
+    return status;
+}
+
+#define JSON_COLUMN_ROWS 1024
+
+static inline void setBit(uint8_t *bits, size_t i) {
+    bits[i >> 3] |= 1 << (i & 7);
+}
+
+static inline void clearBit(uint8_t *bits, size_t i) {
+    bits[i >> 3] &= ~(1 << (i & 7));
+}
+
+static bool growZeroed(void *p, size_t from, size_t to) {
+    if (to == 0)
+        return true; // realloc to zero bytes may free or fail
+    void *q = realloc(*(void **)p, to);
+    if (!q)
+        return false;
+    memset((char *)q + from, 0, to - from);
+    *(void **)p = q;
+    return true;
+}
+
+static size_t columnBytes(JsonColumnType type, size_t rows) {
+    switch (type) {
+    case JSON_COLUMN_BOOL:
+        return (rows + 7) / 8;
+    case JSON_COLUMN_INT64:
+    case JSON_COLUMN_DOUBLE:
+        return rows * 8;
+    case JSON_COLUMN_STRING:
+        return (rows + 1) * sizeof(int32_t);
+    default:
+        return 0;
+    }
+}
+
+// Row being written is columns.rows, column has value for it once its filled
+// count goes past that.
+struct JsonColumnWriter {
+    JsonColumns &c;
+    size_t member;
+
+    bool infer() const {
+        return c.infer;
+    }
+    bool setType(JsonColumn &column, JsonColumnType type) {
+        size_t bytes = columnBytes(type, c.rowCapacity);
+        void **buffer = type == JSON_COLUMN_STRING ? (void **)&column.offsets : &column.values;
+        if (bytes && !growZeroed(buffer, 0, bytes))
+            return false;
+        column.type = type;
+        return true;
+    }
+    bool reserveRows() {
+        if (c.rows < c.rowCapacity)
+            return true;
+        size_t rows = c.rowCapacity ? c.rowCapacity * 2 : JSON_COLUMN_ROWS;
+        for (size_t i = 0; i < c.count; ++i) {
+            JsonColumn &column = c.columns[i];
+            void **buffer = column.type == JSON_COLUMN_STRING ? (void **)&column.offsets : &column.values;
+            size_t from = columnBytes(column.type, c.rowCapacity), to = columnBytes(column.type, rows);
+            if (!growZeroed(&column.validity, c.rowCapacity / 8, rows / 8) || (to && !growZeroed(buffer, from, to)))
+                return false;
+        }
+        c.rowCapacity = rows;
+        return true;
+    }
+    bool index(int i) {
+        if (!c.slots || (size_t)i * 2 > c.mask) {
+            size_t size = c.mask ? (c.mask + 1) * 2 : 64;
+            int *slots = (int *)malloc(size * sizeof(int));
+            if (!slots)
+                return false;
+            memset(slots, -1, size * sizeof(int));
+            free(c.slots);
+            c.slots = slots;
+            c.mask = size - 1;
+            for (int j = 0; j < i; ++j)
+                index(j);
+        }
+        size_t h = hashString(c.columns[i].name) & c.mask;
+        while (c.slots[h] != -1)
+            h = (h + 1) & c.mask;
+        c.slots[h] = i;
+        return true;
+    }
+    int lookup(const char *key) const {
+        if (!c.slots)
+            return -1;
+        for (size_t h = hashString(key) & c.mask; c.slots[h] != -1; h = (h + 1) & c.mask) {
+            if (!strcmp(c.columns[c.slots[h]].name, key))
+                return c.slots[h];
+        }
+        return -1;
+    }
+    int add(const char *name, JsonColumnType type, bool declared) {
+        if (c.count == c.capacity) {
+            size_t capacity = c.capacity ? c.capacity * 2 : 16;
+            JsonColumn *columns = (JsonColumn *)realloc(c.columns, capacity * sizeof(JsonColumn));
+            if (!columns)
+                return -1;
+            c.columns = columns;
+            c.capacity = capacity;
+        }
+        JsonColumn &column = c.columns[c.count];
+        memset(&column, 0, sizeof(column));
+        size_t size = strlen(name) + 1;
+        if ((column.name = (char *)malloc(size)) == nullptr)
+            return -1;
+        memcpy(column.name, name, size);
+        column.nulls = column.filled = c.rows;
+        column.type = JSON_COLUMN_NULL;
+        column.declared = declared;
+        if (!growZeroed(&column.validity, 0, (c.rowCapacity + 7) / 8) || !setType(column, type)) {
+            free(column.validity);
+            free(column.name);
+            return -1;
+        }
+        if (!index(c.count)) {
+            free(column.values);
+            free(column.offsets);
+            free(column.validity);
+            free(column.name);
+            return -1;
+        }
+        return c.count++;
+    }
+    // column of next member, guessed from member order of previous row
+    int find(const char *key) {
+        size_t k = member++;
+        if (k < c.orderSize && c.order[k] != -1 && !strcmp(c.columns[c.order[k]].name, key))
+            return c.order[k];
+        int i = lookup(key);
+        if (i != -1 && k < c.orderCapacity) {
+            c.order[k] = i;
+            if (k >= c.orderSize)
+                c.orderSize = k + 1;
+        }
+        return i;
+    }
+    int beginRow() {
+        member = 0;
+        if (c.orderCapacity < c.count) {
+            int *order = (int *)realloc(c.order, c.count * 2 * sizeof(int));
+            if (!order)
+                return JSON_ALLOCATION_FAILURE;
+            memset(order + c.orderCapacity, -1, (c.count * 2 - c.orderCapacity) * sizeof(int));
+            c.order = order;
+            c.orderCapacity = c.count * 2;
+        }
+        return reserveRows() ? JSON_OK : JSON_ALLOCATION_FAILURE;
+    }
+    // int64 values already written become doubles of same size
+    void widen(JsonColumn &column) {
+        for (size_t row = 0; row < c.rows; ++row) {
+            double x = (double)((int64_t *)column.values)[row];
+            memcpy((double *)column.values + row, &x, sizeof(x));
+        }
+        column.type = JSON_COLUMN_DOUBLE;
+    }
+    // column ready for value of type, null column if member is dropped or
+    // value is stored as null because it does not fit column type
+    int prepare(int &i, const char *key, JsonColumnType type, JsonColumn **result) {
+        *result = nullptr;
+        if (i == -1) {
+            if (!c.infer)
+                return JSON_OK;
+            if ((i = add(key, type, false)) == -1)
+                return JSON_ALLOCATION_FAILURE;
+        }
+        JsonColumn &column = c.columns[i];
+        if (column.filled > c.rows)
+            return JSON_OK; // first of duplicate keys wins
+        if (column.type == JSON_COLUMN_NULL && type != JSON_COLUMN_NULL && !setType(column, type))
+            return JSON_ALLOCATION_FAILURE;
+        if (column.type != type && type != JSON_COLUMN_NULL) {
+            if (column.type == JSON_COLUMN_INT64 && type == JSON_COLUMN_DOUBLE && !column.declared)
+                widen(column);
+            else if (!(column.type == JSON_COLUMN_DOUBLE && type == JSON_COLUMN_INT64))
+                type = JSON_COLUMN_NULL;
+        }
+        ++column.filled;
+        if (type == JSON_COLUMN_NULL)
+            ++column.nulls;
+        else
+            setBit(column.validity, c.rows);
+        if (column.type == JSON_COLUMN_STRING)
+            column.offsets[c.rows + 1] = column.offsets[c.rows];
+        if (type != JSON_COLUMN_NULL)
+            *result = &column;
+        return JSON_OK;
+    }
+    int null(int i, const char *key) {
+        JsonColumn *column;
+        return prepare(i, key, JSON_COLUMN_NULL, &column);
+    }
+    int boolean(int i, const char *key, bool x) {
+        JsonColumn *column;
+        int status = prepare(i, key, JSON_COLUMN_BOOL, &column);
+        if (column && x)
+            setBit((uint8_t *)column->values, c.rows);
+        return status;
+    }
+    int number(int i, const char *key, double x) {
+        JsonColumn *column;
+        bool integral = x >= -9223372036854775808.0 && x < 9223372036854775808.0 && x == (double)(int64_t)x;
+        int status = prepare(i, key, integral ? JSON_COLUMN_INT64 : JSON_COLUMN_DOUBLE, &column);
+        if (!column)
+            return status;
+        if (column->type == JSON_COLUMN_INT64) {
+            ((int64_t *)column->values)[c.rows] = (int64_t)x;
+        } else {
+            ((double *)column->values)[c.rows] = x;
+        }
+        return status;
+    }
+    int string(int i, const char *key, const char *s, size_t size) {
+        JsonColumn *column;
+        int status = prepare(i, key, JSON_COLUMN_STRING, &column);
+        if (!column)
+            return status;
+        if (column->dataSize + size > INT32_MAX) {
+            clearBit(column->validity, c.rows);
+            --column->filled;
+            return JSON_ALLOCATION_FAILURE;
+        }
+        if (column->dataSize + size > column->dataCapacity) {
+            size_t capacity = column->dataCapacity ? column->dataCapacity * 2 : 4096;
+            while (capacity < column->dataSize + size)
+                capacity *= 2;
+            char *data = (char *)realloc(column->data, capacity);
+            if (!data) {
+                clearBit(column->validity, c.rows);
+                --column->filled;
+                return JSON_ALLOCATION_FAILURE;
+            }
+            column->data = data;
+            column->dataCapacity = capacity;
+        }
+        memcpy(column->data + column->dataSize, s, size);
+        column->dataSize += size;
+        column->offsets[c.rows + 1] = column->dataSize;
+        return status;
+    }
+    void endRow() {
+        for (size_t i = 0; i < c.count; ++i) {
+            JsonColumn &column = c.columns[i];
+            if (column.filled == c.rows) {
+                ++column.filled;
+                ++column.nulls;
+                if (column.type == JSON_COLUMN_STRING)
+                    column.offsets[c.rows + 1] = column.offsets[c.rows];
+            }
+        }
+        ++c.rows;
+    }
+    // drops values of failed row, so all columns keep same length
+    void discardRow() {
+        for (size_t i = 0; i < c.count; ++i) {
+            JsonColumn &column = c.columns[i];
+            if (column.filled == c.rows)
+                continue;
+            column.filled = c.rows;
+            if (column.validity[c.rows >> 3] & (1 << (c.rows & 7)))
+                clearBit(column.validity, c.rows);
+            else
+                --column.nulls;
+            if (column.type == JSON_COLUMN_BOOL)
+                clearBit((uint8_t *)column.values, c.rows);
+            if (column.type == JSON_COLUMN_STRING)
+                column.dataSize = column.offsets[c.rows];
+        }
+    }
+};
+
+int JsonColumns::declare(const char *name, JsonColumnType type) {
+    JsonColumnWriter writer{*this, 0};
+    if (writer.lookup(name) != -1)
+        return JSON_OK;
+    return writer.add(name, type, true) == -1 ? JSON_ALLOCATION_FAILURE : JSON_OK;
+}
+
+const JsonColumn *JsonColumns::find(const char *name) const {
+    JsonColumnWriter writer{const_cast<JsonColumns &>(*this), 0};
+    int i = writer.lookup(name);
+    return i == -1 ? nullptr : &columns[i];
+}
+
+void JsonColumns::deallocate() {
+    for (size_t i = 0; i < count; ++i) {
+        free(columns[i].name);
+        free(columns[i].validity);
+        free(columns[i].values);
+        free(columns[i].offsets);
+        free(columns[i].data);
+    }
+    free(columns);
+    free(order);
+    free(slots);
+    columns = nullptr;
+    order = nullptr;
+    slots = nullptr;
+    count = capacity = rows = rowCapacity = orderSize = orderCapacity = mask = 0;
+}
+
+static int extractMember(JsonColumnWriter &writer, JsonNode *member) {
+    int i = writer.find(member->key);
+    JsonValue value = member->value;
+    switch (value.getTag()) {
+    case JSON_NUMBER:
+        return writer.number(i, member->key, value.toNumber());
+    case JSON_STRING:
+        return writer.string(i, member->key, value.toString(), strlen(value.toString()));
+    case JSON_TRUE:
+    case JSON_FALSE:
+        return writer.boolean(i, member->key, value.getTag() == JSON_TRUE);
+    case JSON_NULL:
+        return writer.null(i, member->key);
+    default:
+        return JSON_OK;
+    }
+}
+
+int jsonExtract(JsonValue array, JsonColumns &columns) {
+    if (array.getTag() != JSON_ARRAY)
+        return JSON_TYPE_MISMATCH;
+    JsonColumnWriter writer{columns, 0};
+    for (auto row : array) {
+        if (row->value.getTag() != JSON_OBJECT)
+            return JSON_TYPE_MISMATCH;
+        int status = writer.beginRow();
+        for (auto i = row->value.toNode(); i && status == JSON_OK; i = i->next)
+            status = extractMember(writer, i);
+        if (status != JSON_OK) {
+            writer.discardRow();
+            return status;
+        }
+        writer.endRow();
+    }
+    return JSON_OK;
+}
+
+// Top level members of one record per line, unknown keys are skipped by
+// tokenizer when schema is fixed. Row is finished by caller once whole line
+// is known to be good.
+struct JsonColumnEvents {
+    JsonColumnWriter &writer;
+    int depth;
+    int column;
+    char *name;
+    bool row;
+
+    int value() {
+        return depth == 0 ? JSON_TYPE_MISMATCH : JSON_OK;
+    }
+    int startArray() {
+        return depth++ == 0 ? JSON_TYPE_MISMATCH : JSON_OK;
+    }
+    int endArray() {
+        --depth;
+        return JSON_OK;
+    }
+    int startObject() {
+        if (depth++ != 0)
+            return JSON_OK;
+        row = true;
+        return writer.beginRow();
+    }
+    int endObject() {
+        --depth;
+        return JSON_OK;
+    }
+    int key(char *s, size_t) {
+        if (depth != 1)
+            return JSON_OK;
+        name = s;
+        column = writer.find(s);
+        return column == -1 && !writer.infer() ? JSON_SKIP : JSON_OK;
+    }
+    int string(char *s, size_t size) {
+        return depth == 1 ? writer.string(column, name, s, size) : value();
+    }
+    int number(double x) {
+        return depth == 1 ? writer.number(column, name, x) : value();
+    }
+    int boolean(bool x) {
+        return depth == 1 ? writer.boolean(column, name, x) : value();
+    }
+    int null() {
+        return depth == 1 ? writer.null(column, name) : value();
+    }
+};
+
+int jsonExtractLines(char *s, char **endptr, JsonColumns &columns) {
+    JsonColumnWriter writer{columns, 0};
+    while (*s) {
+        char *eol = strchr(s, '\n');
+        char *next = eol ? eol + 1 : s + strlen(s);
+        if (eol)
+            *eol = 0;
+        while (jsonIsSpace(*s))
+            ++s;
+        if (*s) {
+            JsonColumnEvents events{writer, 0, -1, nullptr, false};
+            int status = jsonParseEvents(s, endptr, events);
+            if (status == JSON_OK) {
+                s = *endptr;
+                while (jsonIsSpace(*s))
+                    ++s;
+                if (*s) {
+                    *endptr = s;
+                    status = JSON_UNEXPECTED_CHARACTER;
+                }
+            }
+            if (status != JSON_OK) {
+                if (events.row)
+                    writer.discardRow();
+                return status;
+            }
+            writer.endRow();
+        }
+        s = next;
+    }
+    *endptr = s;
+    return JSON_OK;
 }
@@ -2,7 +2,20 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <float.h>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+
+#ifndef JSON_STACK_SIZE
+#define JSON_STACK_SIZE 32
+#endif
+
+#if defined(__GNUC__)
+#define JSON_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define JSON_PREFETCH(p) ((void)(p))
+#endif
 
 enum JsonTag {
     JSON_NUMBER = 0,
@@ -97,7 +110,14 @@ inline JsonIterator end(JsonValue) {
     XX(UNEXPECTED_CHARACTER, "unexpected character") \
     XX(UNQUOTED_KEY, "unquoted key")                 \
     XX(BREAKING_BAD, "breaking bad")                 \
-    XX(ALLOCATION_FAILURE, "allocation failure")
+    XX(ALLOCATION_FAILURE, "allocation failure")     \
+    XX(BAD_TAPE, "bad tape")                         \
+    XX(TYPE_MISMATCH, "type mismatch")               \
+    XX(INPUT_TOO_LARGE, "input too large")           \
+    XX(TOO_MANY_NODES, "too many nodes")             \
+    XX(MEMORY_LIMIT, "memory limit exceeded")        \
+    XX(STRING_TOO_LONG, "string too long")           \
+    XX(DEADLINE_EXCEEDED, "deadline exceeded")
 
 enum JsonErrno {
 #define XX(no, str) JSON_##no,
@@ -107,21 +127,82 @@ enum JsonErrno {
 
 const char *jsonStrError(int err);
 
+// Big region of address space reserved at once and cut into zones. Pages are
+// huge when system has them (explicit hugetlb first, then transparent) and
+// placed on NUMA node of thread that creates arena. Zones are never freed one
+// by one, whole region goes away with arena.
+class JsonArena {
+    char *base;
+    size_t reserved;
+    std::atomic<size_t> used;
+    bool hugetlb;
+
+public:
+    // size is rounded up to huge page, which is asked from system on Linux
+    // and taken as 2 MB elsewhere
+    explicit JsonArena(size_t size);
+    JsonArena(const JsonArena &) = delete;
+    JsonArena &operator=(const JsonArena &) = delete;
+    ~JsonArena();
+    // next zone or null when arena is exhausted
+    void *pop();
+    // block of whole zones, its space comes back only with arena
+    void *pop(size_t size);
+    bool contains(const void *p) const {
+        return (const char *)p >= base && (const char *)p < base + reserved;
+    }
+    size_t size() const {
+        return reserved;
+    }
+    // pages come from hugetlb pool rather than transparent huge pages
+    bool explicitHuge() const {
+        return hugetlb;
+    }
+};
+
+// Free zones shared by allocators of different threads. Each thread keeps its
+// own JsonAllocator bound to pool, zones are taken and returned without locks.
+// Pool made with arena takes new zones from it before falling back to malloc.
+class JsonZonePool {
+    std::atomic<uint64_t> top; // zone address and ABA counter above it
+    JsonArena *arena;
+
+public:
+    JsonZonePool() : top(0), arena(nullptr) {};
+    explicit JsonZonePool(JsonArena &arena) : top(0), arena(&arena) {};
+    JsonZonePool(const JsonZonePool &) = delete;
+    JsonZonePool &operator=(const JsonZonePool &) = delete;
+    ~JsonZonePool();
+    void *pop();
+    void push(void *first, void *last);
+    // block bigger than zone from arena, null without arena
+    void *popBlock(size_t size) {
+        return arena ? arena->pop(size) : nullptr;
+    }
+    bool owns(const void *p) const {
+        return arena && arena->contains(p);
+    }
+};
+
 class JsonAllocator {
     struct Zone {
         Zone *next;
         size_t used;
     } *head;
+    JsonZonePool *pool;
 
 public:
-    JsonAllocator() : head(nullptr) {};
+    JsonAllocator() : head(nullptr), pool(nullptr) {};
+    explicit JsonAllocator(JsonZonePool &pool) : head(nullptr), pool(&pool) {};
     JsonAllocator(const JsonAllocator &) = delete;
     JsonAllocator &operator=(const JsonAllocator &) = delete;
-    JsonAllocator(JsonAllocator &&x) : head(x.head) {
+    JsonAllocator(JsonAllocator &&x) : head(x.head), pool(x.pool) {
         x.head = nullptr;
     }
     JsonAllocator &operator=(JsonAllocator &&x) {
+        deallocate();
         head = x.head;
+        pool = x.pool;
         x.head = nullptr;
         return *this;
     }
@@ -130,6 +211,1069 @@ public:
     }
     void *allocate(size_t size);
     void deallocate();
+    // takes over zones of other allocator, and its pool if this has none;
+    // allocators bound to different pools are not merged and false is
+    // returned, zones of arena must go back only to their own pool
+    bool merge(JsonAllocator &x);
+    JsonZonePool *zonePool() const {
+        return pool;
+    }
 };
 
 int jsonParse(char *str, char **endptr, JsonValue *value, JsonAllocator &allocator);
+
+// Builds only members selected by projection, for example parsed text
+// {"id": true, "user": {"name": true}}. Other values are skipped without
+// node allocation, unescaping or number conversion and are not validated.
+int jsonParse(char *str, char **endptr, JsonValue *value, JsonAllocator &allocator, JsonValue projection);
+
+// Where parsing stopped, filled only on failure. Nothing is counted while
+// parsing, line and path are worked out after error from endptr and parser
+// state.
+struct JsonError {
+    size_t offset;    // of endptr from start of text
+    size_t line;      // from 1
+    size_t column;    // in bytes, from 1
+    const char *path; // JSON Pointer of value that failed, in allocator
+};
+
+int jsonParse(char *str, char **endptr, JsonValue *value, JsonAllocator &allocator, JsonError *error);
+
+// Line and column of endptr in text that parser has stopped at. Newlines
+// made by unescaping are told from line breaks only in text parsed with
+// marks, as jsonParse with JsonError does, elsewhere they are counted too.
+void jsonLocate(const char *str, const char *endptr, size_t *line, size_t *column);
+
+// Newline delimited records of batch input, one document per line.
+struct JsonRecords {
+    char *text;
+    char *next;  // first byte of next record
+    size_t line; // line of last parsed record
+    explicit JsonRecords(char *str) : text(str), next(str), line(0) {};
+};
+
+// Parses next record which is not blank. Returns false at end of text,
+// otherwise status of record, bad record does not stop the batch: next call
+// goes on from the line after it. Offset and line of error count from start
+// of whole text, trailing content after document is an error.
+bool jsonParseRecord(JsonRecords &records, int *status, JsonValue *value, JsonAllocator &allocator, JsonError *error = nullptr);
+
+// Budgets for parsing untrusted text, zero or default deadline means no limit.
+// Parse stops with its own status as soon as any of them is exceeded.
+struct JsonLimits {
+    size_t input;  // bytes of text before terminating zero
+    size_t nodes;  // values of any type, containers included
+    size_t memory; // bytes of nodes taken from allocator
+    size_t string; // bytes of one string or key after unescaping
+    std::chrono::steady_clock::time_point deadline; // checked every 4096 values
+};
+
+int jsonParse(char *str, char **endptr, JsonValue *value, JsonAllocator &allocator, const JsonLimits &limits);
+
+// returned by handler from key() to drop member without parsing its value
+#define JSON_SKIP (-1)
+
+// replaces opening quote of string whose unescaped text has newline, when
+// jsonParseEvents is asked to mark
+#define JSON_STRING_MARK '\x01'
+
+constexpr bool jsonIsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+constexpr bool jsonIsDelim(char c) {
+    return c == ',' || c == ':' || c == ']' || c == '}' || jsonIsSpace(c) || !c;
+}
+
+constexpr bool jsonIsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool jsonIsXDigit(char c) {
+    return (c >= '0' && c <= '9') || ((c & ~' ') >= 'A' && (c & ~' ') <= 'F');
+}
+
+constexpr int jsonCharToInt(char c) {
+    return c <= '9' ? c - '0' : (c & ~' ') - 'A' + 10;
+}
+
+// helpers which also run at compile time, see JSON_STATIC
+#if __cplusplus >= 201402L
+#define JSON_CONSTEXPR14 constexpr
+#else
+#define JSON_CONSTEXPR14 inline
+#endif
+
+template <typename Char>
+JSON_CONSTEXPR14 double jsonStringToDouble(Char *s, Char **endptr) {
+    char ch = *s;
+    if (ch == '-')
+        ++s;
+
+    double result = 0;
+    while (jsonIsDigit(*s))
+        result = (result * 10) + (*s++ - '0');
+
+    if (*s == '.') {
+        ++s;
+
+        double fraction = 1;
+        while (jsonIsDigit(*s)) {
+            fraction *= 0.1;
+            result += (*s++ - '0') * fraction;
+        }
+    }
+
+    if (*s == 'e' || *s == 'E') {
+        ++s;
+
+        double base = 10;
+        if (*s == '+')
+            ++s;
+        else if (*s == '-') {
+            ++s;
+            base = 0.1;
+        }
+
+        unsigned int exponent = 0;
+        while (jsonIsDigit(*s))
+            exponent = (exponent * 10) + (*s++ - '0');
+
+        // base is not squared past last bit, so constant evaluation does
+        // not overflow for exponents in range
+        double power = 1;
+        for (; exponent; exponent >>= 1) {
+            if (exponent & 1)
+                power *= base;
+            if (exponent > 1)
+                base *= base;
+        }
+
+        result *= power;
+    }
+
+    *endptr = s;
+    return ch == '-' ? -result : result;
+}
+
+// first character of s which does not continue literal
+inline char *jsonMismatch(char *s, const char *rest) {
+    while (*rest && *s == *rest)
+        ++s, ++rest;
+    return s;
+}
+
+// Skips value without validation: strings are not unescaped, numbers are not
+// converted, only quotes and brackets are matched.
+inline int jsonSkipValue(char *s, char **endptr) {
+    int depth = 0;
+    *endptr = s;
+    do {
+        switch (*s++) {
+        case '"':
+            for (; *s != '"'; ++s) {
+                if (!*s) {
+                    *endptr = s;
+                    return JSON_BAD_STRING;
+                }
+                if (*s == '\\' && s[1])
+                    ++s;
+            }
+            ++s;
+            break;
+        case '[':
+        case '{':
+            ++depth;
+            break;
+        case ']':
+        case '}':
+            if (--depth < 0)
+                return JSON_UNEXPECTED_CHARACTER;
+            break;
+        case '\0':
+            *endptr = s - 1;
+            return JSON_BREAKING_BAD;
+        default:
+            if (depth == 0) {
+                if (jsonIsDelim(s[-1]))
+                    return JSON_UNEXPECTED_CHARACTER;
+                while (!jsonIsDelim(*s))
+                    ++s;
+            }
+            break;
+        }
+    } while (depth);
+    *endptr = s;
+    return JSON_OK;
+}
+
+// Tokenizer shared by all parser outputs. Handler receives events in document
+// order, every method returns int status:
+//   startArray() endArray() startObject() endObject()
+//   key(char *s, size_t size) string(char *s, size_t size)
+//   number(double x) boolean(bool x) null()
+// Strings are unescaped in place and zero terminated. With mark, opening quote
+// of string with escaped newline becomes JSON_STRING_MARK for jsonLocate,
+// otherwise quotes are left alone. Any status other than JSON_OK stops
+// parsing and is returned as is, except JSON_SKIP from key() which skips
+// value of that member.
+template <typename Handler>
+int jsonParseEvents(char *s, char **endptr, Handler &handler, bool mark = false) {
+    JsonTag tags[JSON_STACK_SIZE];
+    bool keys[JSON_STACK_SIZE];
+    int pos = -1;
+    bool separator = true;
+    int status;
+    *endptr = s;
+
+    while (*s) {
+        while (jsonIsSpace(*s)) {
+            ++s;
+            if (!*s) break;
+        }
+        *endptr = s++;
+        switch (**endptr) {
+        case '-':
+            if (!jsonIsDigit(*s) && *s != '.') {
+                *endptr = s;
+                return JSON_BAD_NUMBER;
+            }
+            // fallthrough
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9': {
+            double x = jsonStringToDouble(*endptr, &s);
+            if (!jsonIsDelim(*s)) {
+                *endptr = s;
+                return JSON_BAD_NUMBER;
+            }
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos])
+                return JSON_UNQUOTED_KEY;
+            status = handler.number(x);
+            break;
+        }
+        case '"': {
+            char *str = s;
+            char *it = s;
+            for (;; ++it, ++s) {
+                // nothing is stored before it is checked, so text before
+                // endptr of bad string has no copied control characters
+                int c = *s;
+                if (c == '\\') {
+                    c = *++s;
+                    switch (c) {
+                    case '\\':
+                    case '"':
+                    case '/':
+                        *it = c;
+                        break;
+                    case 'b':
+                        *it = '\b';
+                        break;
+                    case 'f':
+                        *it = '\f';
+                        break;
+                    case 'n':
+                        // newline made by unescaping is not line break,
+                        // see jsonLocate
+                        if (mark)
+                            str[-1] = JSON_STRING_MARK;
+                        *it = '\n';
+                        break;
+                    case 'r':
+                        *it = '\r';
+                        break;
+                    case 't':
+                        *it = '\t';
+                        break;
+                    case 'u':
+                        c = 0;
+                        for (int i = 0; i < 4; ++i) {
+                            if (jsonIsXDigit(*++s)) {
+                                c = c * 16 + jsonCharToInt(*s);
+                            } else {
+                                *endptr = s;
+                                return JSON_BAD_STRING;
+                            }
+                        }
+                        if (c < 0x80) {
+                            if (c == '\n' && mark)
+                                str[-1] = JSON_STRING_MARK;
+                            *it = c;
+                        } else if (c < 0x800) {
+                            *it++ = 0xC0 | (c >> 6);
+                            *it = 0x80 | (c & 0x3F);
+                        } else {
+                            *it++ = 0xE0 | (c >> 12);
+                            *it++ = 0x80 | ((c >> 6) & 0x3F);
+                            *it = 0x80 | (c & 0x3F);
+                        }
+                        break;
+                    default:
+                        *endptr = s;
+                        return JSON_BAD_STRING;
+                    }
+                } else if ((unsigned int)c < ' ' || c == '\x7F') {
+                    *endptr = s;
+                    return JSON_BAD_STRING;
+                } else if (c == '"') {
+                    *it = 0;
+                    ++s;
+                    break;
+                } else {
+                    *it = c;
+                }
+            }
+            if (!jsonIsDelim(*s)) {
+                *endptr = s;
+                return JSON_BAD_STRING;
+            }
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos]) {
+                if ((status = handler.key(str, it - str)) == JSON_SKIP) {
+                    // value is skipped right here, colon may be missing as
+                    // it may for any other member
+                    while (jsonIsSpace(*s))
+                        ++s;
+                    if (*s == ':')
+                        ++s;
+                    while (jsonIsSpace(*s))
+                        ++s;
+                    if ((status = jsonSkipValue(s, endptr)) != JSON_OK)
+                        return status;
+                    s = *endptr;
+                    separator = false;
+                    continue;
+                }
+                if (status != JSON_OK)
+                    return status;
+                keys[pos] = true;
+                separator = false;
+                continue;
+            }
+            status = handler.string(str, it - str);
+            break;
+        }
+        case 't':
+            if (!(s[0] == 'r' && s[1] == 'u' && s[2] == 'e' && jsonIsDelim(s[3]))) {
+                *endptr = jsonMismatch(s, "rue");
+                return JSON_BAD_IDENTIFIER;
+            }
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos])
+                return JSON_UNQUOTED_KEY;
+            status = handler.boolean(true);
+            s += 3;
+            break;
+        case 'f':
+            if (!(s[0] == 'a' && s[1] == 'l' && s[2] == 's' && s[3] == 'e' && jsonIsDelim(s[4]))) {
+                *endptr = jsonMismatch(s, "alse");
+                return JSON_BAD_IDENTIFIER;
+            }
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos])
+                return JSON_UNQUOTED_KEY;
+            status = handler.boolean(false);
+            s += 4;
+            break;
+        case 'n':
+            if (!(s[0] == 'u' && s[1] == 'l' && s[2] == 'l' && jsonIsDelim(s[3]))) {
+                *endptr = jsonMismatch(s, "ull");
+                return JSON_BAD_IDENTIFIER;
+            }
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos])
+                return JSON_UNQUOTED_KEY;
+            status = handler.null();
+            s += 3;
+            break;
+        case ']':
+            if (pos == -1)
+                return JSON_STACK_UNDERFLOW;
+            if (tags[pos] != JSON_ARRAY)
+                return JSON_MISMATCH_BRACKET;
+            --pos;
+            status = handler.endArray();
+            break;
+        case '}':
+            if (pos == -1)
+                return JSON_STACK_UNDERFLOW;
+            if (tags[pos] != JSON_OBJECT)
+                return JSON_MISMATCH_BRACKET;
+            if (keys[pos])
+                return JSON_UNEXPECTED_CHARACTER;
+            --pos;
+            status = handler.endObject();
+            break;
+        case '[':
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos])
+                return JSON_UNQUOTED_KEY;
+            if (++pos == JSON_STACK_SIZE)
+                return JSON_STACK_OVERFLOW;
+            tags[pos] = JSON_ARRAY;
+            keys[pos] = false;
+            if ((status = handler.startArray()) != JSON_OK)
+                return status;
+            separator = true;
+            continue;
+        case '{':
+            if (pos != -1 && tags[pos] == JSON_OBJECT && !keys[pos])
+                return JSON_UNQUOTED_KEY;
+            if (++pos == JSON_STACK_SIZE)
+                return JSON_STACK_OVERFLOW;
+            tags[pos] = JSON_OBJECT;
+            keys[pos] = false;
+            if ((status = handler.startObject()) != JSON_OK)
+                return status;
+            separator = true;
+            continue;
+        case ':':
+            if (separator || !keys[pos])
+                return JSON_UNEXPECTED_CHARACTER;
+            separator = true;
+            continue;
+        case ',':
+            if (separator || keys[pos])
+                return JSON_UNEXPECTED_CHARACTER;
+            separator = true;
+            continue;
+        case '\0':
+            return JSON_BREAKING_BAD;
+        default:
+            return JSON_UNEXPECTED_CHARACTER;
+        }
+
+        if (status != JSON_OK)
+            return status;
+
+        separator = false;
+
+        if (pos == -1) {
+            *endptr = s;
+            return JSON_OK;
+        }
+
+        keys[pos] = false;
+    }
+    *endptr = s;
+    return JSON_BREAKING_BAD;
+}
+
+// Parsed document that owns copy of its text and nodes. Nothing modifies
+// tree after parse, so any number of threads may read it at once, last
+// release() frees it.
+class JsonDocument {
+    std::atomic<int> refs;
+    JsonAllocator allocator;
+    JsonValue root;
+
+    JsonDocument(JsonAllocator &&allocator, JsonValue root) : refs(1), allocator(static_cast<JsonAllocator &&>(allocator)), root(root) {};
+    friend int jsonParse(const char *, size_t, JsonDocument **, JsonZonePool *);
+
+public:
+    JsonDocument(const JsonDocument &) = delete;
+    JsonDocument &operator=(const JsonDocument &) = delete;
+    JsonValue value() const {
+        return root;
+    }
+    void retain() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release();
+};
+
+int jsonParse(const char *text, size_t size, JsonDocument **document, JsonZonePool *pool = nullptr);
+
+// Parses big array or object of size bytes on several threads (all hardware
+// threads if zero). Chunks of text are scanned in parallel for quotes and
+// brackets first, which gives positions of top level commas, then every
+// thread parses its run of elements and lists are linked at the end. Text
+// whose root closes early or whose largest run is over half of it goes to
+// jsonParse instead. Status and endptr are meant to match jsonParse, also on
+// bad text; that is checked against damaged documents, not proven.
+int jsonParseParallel(char *str, size_t size, char **endptr, JsonValue *value, JsonAllocator &allocator, unsigned threads = 0);
+
+struct JsonEdit {
+    size_t offset;   // first changed byte
+    size_t removed;  // bytes removed from previous text
+    size_t inserted; // bytes inserted in their place
+};
+
+// Updates value parsed from source after edit of its text. text is new
+// document of size bytes, source must have room for size + 1 bytes. Only the
+// smallest object member or array element enclosing edit is parsed again and
+// spliced in, nodes of replaced one stay in allocator. Elements are located
+// through strings they hold, so edit among numbers, literals or empty
+// containers goes to enclosing member. If length changes, text after edit is
+// moved and only nodes after it are fixed up. If edit changes structure,
+// enclosing spans are tried, then whole text is parsed into reset allocator.
+// After splice *endptr points at end of reparsed span, not at end of document
+// as after full parse; status is always the one full parse would give.
+int jsonReparse(char *source, const char *text, size_t size, JsonEdit edit, char **endptr, JsonValue *value, JsonAllocator &allocator);
+
+// Walks value in document order with explicit stack, prefetching next node
+// while visitor handles current one. Visitor::enter(value, key) is called for
+// every value (key is null for root and array elements), returning false
+// skips container members. Visitor::leave(value) is called after members of
+// entered container.
+template <typename Visitor>
+int jsonWalk(JsonValue value, Visitor &visitor) {
+    JsonValue containers[JSON_STACK_SIZE];
+    JsonNode *nodes[JSON_STACK_SIZE];
+    int pos = -1;
+    const char *key = nullptr;
+    for (;;) {
+        JsonTag tag = value.getTag();
+        if (visitor.enter(value, key) && (tag == JSON_ARRAY || tag == JSON_OBJECT)) {
+            if (++pos == JSON_STACK_SIZE)
+                return JSON_STACK_OVERFLOW;
+            containers[pos] = value;
+            nodes[pos] = value.toNode();
+            JSON_PREFETCH(nodes[pos]);
+        }
+        for (;;) {
+            if (pos == -1)
+                return JSON_OK;
+            JsonNode *node = nodes[pos];
+            if (node) {
+                nodes[pos] = node->next;
+                JSON_PREFETCH(node->next);
+                value = node->value;
+                key = containers[pos].getTag() == JSON_OBJECT ? node->key : nullptr;
+                break;
+            }
+            visitor.leave(containers[pos--]);
+        }
+    }
+}
+
+enum JsonOrder {
+    JSON_DEPTH_FIRST,
+    JSON_BREADTH_FIRST
+};
+
+// Copies value with its strings into one block of allocator, so members of
+// long-lived documents sit next to each other in traversal order. Breadth
+// first order keeps members of every container contiguous, at cost of full
+// sized nodes for array elements.
+int jsonCompact(JsonValue value, JsonValue *result, JsonAllocator &allocator, JsonOrder order = JSON_DEPTH_FIRST);
+
+// Deep equality with early exit. Object members are matched by key in any
+// order, through hash index when they are not in same order. Duplicate keys
+// count as separate members: each member pairs with one equal member of
+// other object, like multiset, which is also what jsonHash adds up.
+bool jsonEqual(JsonValue a, JsonValue b);
+
+// RFC 6902 patch which turns from into to: array of {"op", "path", "value"}
+// objects. Arrays are compared by position, objects by key, and with
+// duplicate keys each member of to pairs with one member of from, extra
+// ones are removed or added. Patch values point into to, so patch is valid
+// while both to and allocator live.
+int jsonDiff(JsonValue from, JsonValue to, JsonValue *patch, JsonAllocator &allocator);
+
+// 128-bit structural hash: values equal by jsonEqual hash equal, so neither
+// whitespace nor member order of objects changes it.
+struct JsonHash {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const JsonHash &x) const {
+        return low == x.low && high == x.high;
+    }
+    bool operator!=(const JsonHash &x) const {
+        return !(*this == x);
+    }
+};
+
+// Hashes of containers remembered by jsonHash, table lives in allocator. Keyed
+// by container nodes, so it is valid while trees are not changed in place
+// (jsonReparse does that).
+class JsonHashCache {
+    struct Entry;
+    JsonAllocator &allocator;
+    Entry *entries;
+    size_t mask;
+    size_t count;
+
+public:
+    explicit JsonHashCache(JsonAllocator &allocator)
+        : allocator(allocator), entries(nullptr), mask(0), count(0) {
+    }
+    bool find(JsonNode *node, JsonHash *hash) const;
+    bool insert(JsonNode *node, JsonHash hash);
+};
+
+// Hash of whole value in one pass. With cache, hashes of already seen
+// containers are reused and new ones are stored.
+int jsonHash(JsonValue value, JsonHash *hash, JsonHashCache *cache = nullptr);
+
+// Equality through cache: containers are compared by their 128-bit hashes,
+// which is one lookup each once hashed, so equal documents cost O(1) too.
+// Different values with the same hash compare equal. Chance of that is
+// negligible for ordinary data, but hash is not keyed, so text crafted to
+// collide must go through plain jsonEqual. Without memory for cache it falls
+// back to plain jsonEqual.
+bool jsonEqual(JsonValue a, JsonValue b, JsonHashCache &cache);
+
+// Tape is a flat binary image of a value: four header words (magic, entry
+// count, string bytes, node bytes needed to decode), entries in document
+// order and a pool of zero terminated strings. Entries are NaN-boxed like
+// JsonValue, but string payload is an offset into the pool and array/object
+// payload is the number of entries in the subtree, object members are stored
+// as key, value pairs.
+#define JSON_TAPE_MAGIC 0x3145504154534A47ULL
+#define JSON_TAPE_HEADER_SIZE 4
+
+// Tape contains only offsets, so it can be copied, mapped from file or
+// shared memory at any address and read in place without decoding.
+struct JsonTapeValue {
+    const JsonValue *p;
+    const char *strings;
+
+    JsonTag getTag() const {
+        return p->getTag();
+    }
+    double toNumber() const {
+        return p->toNumber();
+    }
+    const char *toString() const {
+        assert(getTag() == JSON_STRING);
+        return strings + p->getPayload();
+    }
+    const JsonValue *skip() const {
+        return (getTag() == JSON_ARRAY || getTag() == JSON_OBJECT) ? p + 1 + p->getPayload() : p + 1;
+    }
+};
+
+struct JsonTapeNode {
+    JsonTapeValue value;
+    const char *key;
+};
+
+struct JsonTapeIterator {
+    JsonTapeNode node;
+    const JsonValue *last;
+    bool keyed;
+
+    void load(const JsonValue *p) {
+        if (p != last && keyed) {
+            node.key = node.value.strings + p->getPayload();
+            ++p;
+        }
+        node.value.p = p;
+    }
+    void operator++() {
+        load(node.value.skip());
+    }
+    bool operator!=(const JsonTapeIterator &x) const {
+        return node.value.p != x.node.value.p;
+    }
+    const JsonTapeNode *operator*() const {
+        return &node;
+    }
+    const JsonTapeNode *operator->() const {
+        return &node;
+    }
+};
+
+inline JsonTapeIterator begin(JsonTapeValue o) {
+    assert(o.getTag() == JSON_ARRAY || o.getTag() == JSON_OBJECT);
+    JsonTapeIterator it{{o, nullptr}, o.skip(), o.getTag() == JSON_OBJECT};
+    it.load(o.p + 1);
+    return it;
+}
+inline JsonTapeIterator end(JsonTapeValue o) {
+    return JsonTapeIterator{{{o.skip(), o.strings}, nullptr}, nullptr, false};
+}
+
+// Checks only tape header, use jsonDecode for untrusted data.
+int jsonTapeRoot(const void *data, size_t size, JsonTapeValue *value);
+
+class JsonTape {
+    char *buffer;
+    size_t length;
+
+    friend struct JsonTapeWriter;
+
+public:
+    JsonTape() : buffer(nullptr), length(0) {};
+    JsonTape(const JsonTape &) = delete;
+    JsonTape &operator=(const JsonTape &) = delete;
+    JsonTape(JsonTape &&x) : buffer(x.buffer), length(x.length) {
+        x.buffer = nullptr;
+        x.length = 0;
+    }
+    JsonTape &operator=(JsonTape &&x) {
+        deallocate();
+        buffer = x.buffer;
+        length = x.length;
+        x.buffer = nullptr;
+        x.length = 0;
+        return *this;
+    }
+    ~JsonTape() {
+        deallocate();
+    }
+    const void *data() const {
+        return buffer;
+    }
+    size_t size() const {
+        return length;
+    }
+    JsonTapeValue root() const {
+        JsonTapeValue value{nullptr, nullptr};
+        jsonTapeRoot(buffer, length, &value);
+        return value;
+    }
+    void deallocate();
+};
+
+// Parses into self-contained tape, source buffer can be freed afterwards.
+int jsonParse(char *str, char **endptr, JsonTape &tape);
+int jsonEncode(JsonValue value, JsonTape &tape);
+// Strings of decoded value point into data, so it must outlive the value.
+int jsonDecode(const void *data, size_t size, JsonValue *value, JsonAllocator &allocator);
+
+#if __cplusplus >= 201402L
+// Compile time parsing of JSON literals, needs C++14:
+//
+//     static constexpr auto defaults = JSON_STATIC(R"({"port": 80})");
+//     JsonTapeValue root = defaults.root();
+//
+// Result is the same tape jsonParse writes, built by compiler into read-only
+// data, so nothing is parsed or allocated at startup. Bad text and nesting
+// deeper than JSON_STACK_SIZE fail compilation in jsonStaticBadText. Numbers
+// out of double range fail compilation too: GCC already stops at overflowing
+// operation in jsonStringToDouble, compilers which evaluate it to infinity
+// get to jsonStaticBadText. Unlike runtime parser, missing separators are
+// errors.
+#define JSON_STATIC(text) jsonStaticParse<jsonStaticMeasure(text).entries, jsonStaticMeasure(text).strings>(text)
+
+// not constexpr on purpose, reaching it stops constant evaluation
+inline bool jsonStaticBadText(const char *) {
+    return false;
+}
+
+// bits of finite non-negative double, scaling by powers of two is exact
+constexpr uint64_t jsonStaticDouble(double x) {
+    if (x == 0)
+        return 0;
+    int exponent = 0;
+    double m = x;
+    while (m >= 2) {
+        m /= 2;
+        ++exponent;
+    }
+    while (m < 1) {
+        m *= 2;
+        --exponent;
+    }
+    if (exponent < -1022) {
+        for (int i = 0; i < 1022; ++i)
+            x *= 2;
+        return (uint64_t)(x * 4503599627370496.0);
+    }
+    return (uint64_t)(exponent + 1023) << 52 | (uint64_t)((m - 1) * 4503599627370496.0);
+}
+
+// Recursive descent over literal, counts entries and string bytes when words
+// and strings are null.
+struct JsonStaticParser {
+    const char *s;
+    uint64_t *words;
+    char *strings;
+    size_t count;
+    size_t used;
+    size_t keys;
+
+    static constexpr uint64_t entry(JsonTag tag, uint64_t payload) {
+        return JSON_VALUE_NAN_MASK | (uint64_t)tag << JSON_VALUE_TAG_SHIFT | payload;
+    }
+    constexpr void push(uint64_t x) {
+        if (words)
+            words[count] = x;
+        ++count;
+    }
+    constexpr void put(char c) {
+        if (strings)
+            strings[used] = c;
+        ++used;
+    }
+    constexpr void space() {
+        while (jsonIsSpace(*s))
+            ++s;
+    }
+    constexpr bool literal(const char *rest, JsonTag tag) {
+        for (++s; *rest; ++s, ++rest)
+            if (*s != *rest)
+                return jsonStaticBadText(s);
+        if (!jsonIsDelim(*s))
+            return jsonStaticBadText(s);
+        push(entry(tag, 0));
+        return true;
+    }
+    constexpr bool number() {
+        bool negative = *s == '-';
+        if (negative && !jsonIsDigit(s[1]) && s[1] != '.')
+            return jsonStaticBadText(s);
+        const char *end = s + negative;
+        double x = jsonStringToDouble(end, &end);
+        if (!jsonIsDelim(*end) || x > DBL_MAX)
+            return jsonStaticBadText(s);
+        s = end;
+        push(jsonStaticDouble(x) | (negative ? 1ULL << 63 : 0));
+        return true;
+    }
+    constexpr bool string() {
+        push(entry(JSON_STRING, used));
+        for (++s;;) {
+            char c = *s++;
+            if (c == '"')
+                break;
+            if ((unsigned char)c < ' ' || c == '\x7F')
+                return jsonStaticBadText(s);
+            if (c != '\\') {
+                put(c);
+                continue;
+            }
+            switch (c = *s++) {
+            case '\\':
+            case '"':
+            case '/':
+                put(c);
+                break;
+            case 'b':
+                put('\b');
+                break;
+            case 'f':
+                put('\f');
+                break;
+            case 'n':
+                put('\n');
+                break;
+            case 'r':
+                put('\r');
+                break;
+            case 't':
+                put('\t');
+                break;
+            case 'u': {
+                int u = 0;
+                for (int i = 0; i < 4; ++i, ++s) {
+                    if (!jsonIsXDigit(*s))
+                        return jsonStaticBadText(s);
+                    u = u * 16 + jsonCharToInt(*s);
+                }
+                if (u < 0x80) {
+                    put(u);
+                } else if (u < 0x800) {
+                    put(0xC0 | (u >> 6));
+                    put(0x80 | (u & 0x3F));
+                } else {
+                    put(0xE0 | (u >> 12));
+                    put(0x80 | ((u >> 6) & 0x3F));
+                    put(0x80 | (u & 0x3F));
+                }
+                break;
+            }
+            default:
+                return jsonStaticBadText(s);
+            }
+        }
+        put(0);
+        return jsonIsDelim(*s) || jsonStaticBadText(s);
+    }
+    constexpr bool container(int depth) {
+        if (depth == JSON_STACK_SIZE)
+            return jsonStaticBadText(s);
+        bool object = *s++ == '{';
+        char close = object ? '}' : ']';
+        size_t start = count;
+        push(0);
+        space();
+        if (*s != close) {
+            for (;;) {
+                if (object) {
+                    space();
+                    if (*s != '"')
+                        return jsonStaticBadText(s);
+                    if (!string())
+                        return false;
+                    ++keys;
+                    space();
+                    if (*s++ != ':')
+                        return jsonStaticBadText(s);
+                }
+                if (!value(depth + 1))
+                    return false;
+                space();
+                if (*s != ',')
+                    break;
+                ++s;
+            }
+            if (*s != close)
+                return jsonStaticBadText(s);
+        }
+        ++s;
+        if (words)
+            words[start] = entry(object ? JSON_OBJECT : JSON_ARRAY, count - start - 1);
+        return true;
+    }
+    constexpr bool value(int depth) {
+        space();
+        switch (*s) {
+        case '"':
+            return string();
+        case '[':
+        case '{':
+            return container(depth);
+        case 't':
+            return literal("rue", JSON_TRUE);
+        case 'f':
+            return literal("alse", JSON_FALSE);
+        case 'n':
+            return literal("ull", JSON_NULL);
+        case '-':
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+            return number();
+        default:
+            return jsonStaticBadText(s);
+        }
+    }
+    constexpr bool parse() {
+        if (!value(0))
+            return false;
+        space();
+        return !*s || jsonStaticBadText(s);
+    }
+};
+
+struct JsonStaticSize {
+    size_t entries;
+    size_t strings;
+};
+
+constexpr JsonStaticSize jsonStaticMeasure(const char *text) {
+    JsonStaticParser parser{text, nullptr, nullptr, 0, 0, 0};
+    parser.parse();
+    return JsonStaticSize{parser.count, parser.used};
+}
+
+// Header, entries and strings laid out exactly like JsonTape buffer.
+template <size_t Entries, size_t Strings>
+struct JsonStaticTape {
+    uint64_t words[JSON_TAPE_HEADER_SIZE + Entries];
+    char strings[Strings + 1];
+
+    const void *data() const {
+        return words;
+    }
+    size_t size() const {
+        return sizeof(words) + Strings;
+    }
+    JsonTapeValue root() const {
+        return JsonTapeValue{(const JsonValue *)(words + JSON_TAPE_HEADER_SIZE), strings};
+    }
+};
+
+template <size_t Entries, size_t Strings>
+constexpr JsonStaticTape<Entries, Strings> jsonStaticParse(const char *text) {
+    JsonStaticTape<Entries, Strings> tape{};
+    JsonStaticParser parser{text, tape.words + JSON_TAPE_HEADER_SIZE, tape.strings, 0, 0, 0};
+    parser.parse();
+    size_t values = Entries - 1 - parser.keys;
+    tape.words[0] = JSON_TAPE_MAGIC;
+    tape.words[1] = Entries;
+    tape.words[2] = Strings;
+    tape.words[3] = values * (sizeof(JsonNode) - sizeof(char *)) + parser.keys * sizeof(char *);
+    return tape;
+}
+#endif
+
+enum JsonColumnType {
+    JSON_COLUMN_NULL, // no value seen yet
+    JSON_COLUMN_BOOL,
+    JSON_COLUMN_INT64,
+    JSON_COLUMN_DOUBLE,
+    JSON_COLUMN_STRING
+};
+
+// Buffers are in Arrow layout: validity and boolean values are bitmaps with
+// least significant bit first, strings are rows + 1 int32 offsets into data.
+struct JsonColumn {
+    char *name;
+    JsonColumnType type;
+    bool declared; // type is fixed, not widened
+    size_t nulls;
+    size_t filled; // rows written to this column
+    uint8_t *validity;
+    void *values; // bitmap, int64_t or double per row
+    int32_t *offsets;
+    char *data;
+    size_t dataSize;
+    size_t dataCapacity;
+};
+
+// Columns of array of records. Schema is inferred from keys as they come:
+// numbers are int64 until first non-integral value widens column to double,
+// and value that fits neither, like string in bool column, is stored as null.
+// Declared columns fix type, and without inference other keys are ignored.
+// Member order of previous row predicts column of every key, so rows with
+// same layout need no key lookup.
+class JsonColumns {
+    JsonColumn *columns;
+    size_t count;
+    size_t capacity;
+    size_t rows;
+    size_t rowCapacity;
+    int *order;
+    size_t orderSize;
+    size_t orderCapacity;
+    int *slots; // open addressing index of column names
+    size_t mask;
+    bool infer;
+
+    friend struct JsonColumnWriter;
+
+public:
+    explicit JsonColumns(bool infer = true)
+        : columns(nullptr), count(0), capacity(0), rows(0), rowCapacity(0), order(nullptr),
+          orderSize(0), orderCapacity(0), slots(nullptr), mask(0), infer(infer) {
+    }
+    JsonColumns(const JsonColumns &) = delete;
+    JsonColumns &operator=(const JsonColumns &) = delete;
+    ~JsonColumns() {
+        deallocate();
+    }
+    int declare(const char *name, JsonColumnType type);
+    size_t size() const {
+        return count;
+    }
+    size_t length() const {
+        return rows;
+    }
+    const JsonColumn &operator[](size_t i) const {
+        return columns[i];
+    }
+    const JsonColumn *find(const char *name) const;
+    void deallocate();
+};
+
+// Appends every element of array, which must be objects. Nested values are
+// not extracted.
+int jsonExtract(JsonValue array, JsonColumns &columns);
+// Appends every line of newline delimited text straight from parser events,
+// text is modified in place like by jsonParse.
+int jsonExtractLines(char *str, char **endptr, JsonColumns &columns);
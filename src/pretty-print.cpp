@@ -1,7 +1,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <math.h>
+#include <thread>
+#include <vector>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #if !defined(_WIN32) && !defined(NDEBUG)
 #include <execinfo.h>
 #include <signal.h>
@@ -9,141 +19,489 @@
 #include "gason.h"
 
 const int SHIFT_WIDTH = 4;
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+const size_t LINES_BLOCK_SIZE = 4 << 20;
 
-void dumpString(const char *s) {
-    fputc('"', stdout);
-    while (*s) {
-        int c = *s++;
-        switch (c) {
-        case '\b':
-            fprintf(stdout, "\\b");
-            break;
-        case '\f':
-            fprintf(stdout, "\\f");
-            break;
-        case '\n':
-            fprintf(stdout, "\\n");
-            break;
-        case '\r':
-            fprintf(stdout, "\\r");
-            break;
-        case '\t':
-            fprintf(stdout, "\\t");
-            break;
-        case '\\':
-            fprintf(stdout, "\\\\");
-            break;
-        case '"':
-            fprintf(stdout, "\\\"");
-            break;
-        default:
-            fputc(c, stdout);
-        }
+// Out of memory ends the program, formatter has nothing to fall back to.
+void *checkedRealloc(void *p, size_t size) {
+    void *q = realloc(p, size);
+    if (!q) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
     }
-    fprintf(stdout, "%s\"", s);
+    return q;
 }
 
-void dumpValue(JsonValue o, int indent = 0) {
-    switch (o.getTag()) {
-    case JSON_NUMBER:
-        fprintf(stdout, "%f", o.toNumber());
-        break;
-    case JSON_STRING:
-        dumpString(o.toString());
-        break;
-    case JSON_ARRAY:
-        // It is not necessary to use o.toNode() to check if an array or object
-        // is empty before iterating over its members, we do it here to allow
-        // nicer pretty printing.
-        if (!o.toNode()) {
-            fprintf(stdout, "[]");
-            break;
+// Output goes to fp in big blocks, or stays in memory when fp is null.
+struct Writer {
+    FILE *fp;
+    char *data;
+    size_t size;
+    size_t capacity;
+
+    Writer(FILE *fp = nullptr, size_t capacity = OUTPUT_BUFFER_SIZE)
+        : fp(fp), data((char *)checkedRealloc(nullptr, capacity)), size(0), capacity(capacity) {
+    }
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+    ~Writer() {
+        flush();
+        free(data);
+    }
+    void reserve(size_t n) {
+        if (size + n <= capacity)
+            return;
+        flush();
+        if (size + n <= capacity)
+            return;
+        while (size + n > capacity)
+            capacity *= 2;
+        data = (char *)checkedRealloc(data, capacity);
+    }
+    void put(char c) {
+        reserve(1);
+        data[size++] = c;
+    }
+    void put(const char *s, size_t n) {
+        reserve(n);
+        memcpy(data + size, s, n);
+        size += n;
+    }
+    void fill(char c, size_t n) {
+        reserve(n);
+        memset(data + size, c, n);
+        size += n;
+    }
+    void format(const char *fmt, ...) {
+        va_list args, again;
+        va_start(args, fmt);
+        va_copy(again, args);
+        reserve(64);
+        int n = vsnprintf(data + size, capacity - size, fmt, args);
+        if (n >= 0 && (size_t)n >= capacity - size) {
+            reserve(n + 1);
+            vsnprintf(data + size, capacity - size, fmt, again);
         }
-        fprintf(stdout, "[\n");
-        for (auto i : o) {
-            fprintf(stdout, "%*s", indent + SHIFT_WIDTH, "");
-            dumpValue(i->value, indent + SHIFT_WIDTH);
-            fprintf(stdout, i->next ? ",\n" : "\n");
+        va_end(again);
+        va_end(args);
+        if (n > 0)
+            size += n;
+    }
+    void flush() {
+        if (fp && size) {
+            fwrite(data, 1, size, fp);
+            size = 0;
         }
-        fprintf(stdout, "%*s]", indent, "");
-        break;
-    case JSON_OBJECT:
-        if (!o.toNode()) {
-            fprintf(stdout, "{}");
+    }
+};
+
+void dumpString(Writer &out, const char *s, size_t size) {
+    static const char escapes[] = "01234567btn3fr";
+    const char *end = s + size;
+    out.put('"');
+    while (s != end) {
+        const char *run = s;
+        while (s != end && (unsigned char)*s >= ' ' && *s != '"' && *s != '\\')
+            ++s;
+        out.put(run, s - run);
+        if (s == end)
             break;
+        int c = (unsigned char)*s++;
+        if (c == '"' || c == '\\') {
+            out.put('\\');
+            out.put(c);
+        } else if (c >= '\b' && c <= '\r' && c != '\v') {
+            out.put('\\');
+            out.put(escapes[c]);
+        } else {
+            out.format("\\u%04x", c);
         }
-        fprintf(stdout, "{\n");
-        for (auto i : o) {
-            fprintf(stdout, "%*s", indent + SHIFT_WIDTH, "");
-            dumpString(i->key);
-            fprintf(stdout, ": ");
-            dumpValue(i->value, indent + SHIFT_WIDTH);
-            fprintf(stdout, i->next ? ",\n" : "\n");
-        }
-        fprintf(stdout, "%*s}", indent, "");
-        break;
-    case JSON_TRUE:
-        fprintf(stdout, "true");
-        break;
-    case JSON_FALSE:
-        fprintf(stdout, "false");
-        break;
-    case JSON_NULL:
-        fprintf(stdout, "null");
-        break;
     }
+    out.put('"');
 }
 
-void printError(const char *filename, int status, char *endptr, char *source, size_t size) {
-    char *s = endptr;
-    while (s != source && *s != '\n')
-        --s;
-    if (s != endptr && s != source)
-        ++s;
-
-    int lineno = 0;
-    for (char *it = s; it != source; --it) {
-        if (*it == '\n') {
-            ++lineno;
+void dumpNumber(Writer &out, double x) {
+    if (fabs(x) < 1e15 && x == (long long)x) {
+        char buffer[24];
+        char *s = buffer + sizeof(buffer);
+        long long n = (long long)x;
+        unsigned long long u = n < 0 ? -(unsigned long long)n : n;
+        do
+            *--s = '0' + u % 10;
+        while (u /= 10);
+        if (n < 0)
+            *--s = '-';
+        out.put(s, buffer + sizeof(buffer) - s);
+    } else if (isinf(x)) {
+        out.put(x < 0 ? "-1e999" : "1e999", x < 0 ? 6 : 5);
+    } else {
+        // shortest of two precisions that reads back same value
+        char buffer[32];
+        int n = snprintf(buffer, sizeof(buffer), "%.15g", x);
+        if (strtod(buffer, nullptr) != x)
+            n = snprintf(buffer, sizeof(buffer), "%.17g", x);
+        out.put(buffer, n);
+    }
+}
+
+// Writes document straight from parser events, so no tree is built.
+// Indent of zero gives compact output.
+struct Printer {
+    Writer &out;
+    int indent;
+    int depth;
+    bool first;
+    bool member;
+
+    Printer(Writer &out, int indent)
+        : out(out), indent(indent), depth(0), first(false), member(false) {
+    }
+    void newline() {
+        out.put('\n');
+        out.fill(' ', depth * indent);
+    }
+    void separate() {
+        if (member) {
+            member = false;
+            return;
         }
+        if (depth == 0)
+            return;
+        if (!first)
+            out.put(',');
+        first = false;
+        if (indent)
+            newline();
     }
+    int open(char c) {
+        separate();
+        out.put(c);
+        ++depth;
+        first = true;
+        return JSON_OK;
+    }
+    int close(char c) {
+        --depth;
+        if (!first && indent)
+            newline();
+        first = false;
+        out.put(c);
+        return JSON_OK;
+    }
+    int startArray() {
+        return open('[');
+    }
+    int endArray() {
+        return close(']');
+    }
+    int startObject() {
+        return open('{');
+    }
+    int endObject() {
+        return close('}');
+    }
+    int key(char *s, size_t size) {
+        separate();
+        dumpString(out, s, size);
+        if (indent)
+            out.put(": ", 2);
+        else
+            out.put(':');
+        member = true;
+        return JSON_OK;
+    }
+    int string(char *s, size_t size) {
+        separate();
+        dumpString(out, s, size);
+        return JSON_OK;
+    }
+    int number(double x) {
+        separate();
+        dumpNumber(out, x);
+        return JSON_OK;
+    }
+    int boolean(bool x) {
+        separate();
+        if (x)
+            out.put("true", 4);
+        else
+            out.put("false", 5);
+        return JSON_OK;
+    }
+    int null() {
+        separate();
+        out.put("null", 4);
+        return JSON_OK;
+    }
+};
 
-    int column = (int)(endptr - s);
+// Takes every event, parse only checks the document.
+struct Validator {
+    int startArray() {
+        return JSON_OK;
+    }
+    int endArray() {
+        return JSON_OK;
+    }
+    int startObject() {
+        return JSON_OK;
+    }
+    int endObject() {
+        return JSON_OK;
+    }
+    int key(char *, size_t) {
+        return JSON_OK;
+    }
+    int string(char *, size_t) {
+        return JSON_OK;
+    }
+    int number(double) {
+        return JSON_OK;
+    }
+    int boolean(bool) {
+        return JSON_OK;
+    }
+    int null() {
+        return JSON_OK;
+    }
+};
 
-    fprintf(stderr, "%s:%d:%d: %s\n", filename, lineno + 1, column + 1, jsonStrError(status));
+void printError(const char *filename, int status, char *endptr, char *source, size_t size, size_t firstLine = 1) {
+    size_t lineno, column;
+    jsonLocate(source, endptr, &lineno, &column);
+    fprintf(stderr, "%s:%zu:%zu: %s\n", filename, firstLine + lineno - 1, column, jsonStrError(status));
 
-    while (s != source + size && *s != '\n') {
+    // unescaped strings may hold newlines before endptr, they are shown escaped
+    char *s = endptr - (column - 1);
+    int caret = (int)column - 1;
+    while (s != source + size && (*s != '\n' || s < endptr)) {
+        int shift = 0;
         int c = *s++;
         switch (c) {
         case '\b':
             fprintf(stderr, "\\b");
-            column += 1;
+            shift = 1;
             break;
         case '\f':
             fprintf(stderr, "\\f");
-            column += 1;
+            shift = 1;
             break;
         case '\n':
             fprintf(stderr, "\\n");
-            column += 1;
+            shift = 1;
             break;
         case '\r':
             fprintf(stderr, "\\r");
-            column += 1;
+            shift = 1;
             break;
         case '\t':
             fprintf(stderr, "%*s", SHIFT_WIDTH, "");
-            column += SHIFT_WIDTH - 1;
+            shift = SHIFT_WIDTH - 1;
             break;
         case '\0':
+        case JSON_STRING_MARK:
             fprintf(stderr, "\"");
             break;
         default:
             fputc(c, stderr);
         }
+        if (s <= endptr)
+            caret += shift;
+    }
+
+    fprintf(stderr, "\n%*s\n", caret + 1, "^");
+}
+
+struct Options {
+    const char *filename;
+    int indent;
+    bool lines;
+    unsigned threads;
+};
+
+// Whole input in memory and zero terminated. Regular files are mapped
+// privately, so parser may write into them without touching the file.
+struct Input {
+    char *data;
+    size_t size;
+    size_t mapped;
+
+    bool load(FILE *fp) {
+        mapped = 0;
+#if !defined(_WIN32)
+        struct stat st;
+        int fd = fileno(fp);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size = st.st_size;
+            // anonymous page after file end keeps terminating zero, file
+            // mapping past its end would fault instead
+            size_t page = sysconf(_SC_PAGESIZE);
+            mapped = (size + page) & ~(page - 1);
+            void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED && mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                data = (char *)p;
+                madvise(data, size, MADV_SEQUENTIAL);
+                return true;
+            }
+            if (p != MAP_FAILED)
+                munmap(p, mapped);
+            mapped = 0;
+        }
+#endif
+        data = nullptr;
+        size = 0;
+        size_t capacity = 0;
+        while (!feof(fp) && !ferror(fp)) {
+            if (size + 1 >= capacity) {
+                capacity = capacity < BUFSIZ ? BUFSIZ : capacity * 2;
+                data = (char *)checkedRealloc(data, capacity);
+            }
+            size += fread(data + size, 1, capacity - size - 1, fp);
+        }
+        if (!data)
+            data = (char *)checkedRealloc(nullptr, 1);
+        data[size] = 0;
+        return !ferror(fp);
+    }
+    void release() {
+#if !defined(_WIN32)
+        if (mapped) {
+            munmap(data, mapped);
+            return;
+        }
+#endif
+        free(data);
+    }
+};
+
+struct Failure {
+    int status;
+    char *endptr;
+    char *line;
+    size_t size;
+    size_t lineno;
+};
+
+// One slice of NDJSON block, formatted by its own thread into own memory.
+struct Slice {
+    char *begin;
+    char *end;
+    size_t lines;
+    std::vector<Failure> failures;
+    Writer out;
+};
+
+void formatLines(Slice &slice, int indent) {
+    slice.lines = 0;
+    for (char *s = slice.begin; s < slice.end; ++slice.lines) {
+        char *eol = (char *)memchr(s, '\n', slice.end - s);
+        if (!eol)
+            eol = slice.end;
+        *eol = 0;
+        char *it = s;
+        while (jsonIsSpace(*it))
+            ++it;
+        if (*it) {
+            size_t rollback = slice.out.size;
+            char *endptr;
+            Printer printer(slice.out, indent);
+            int status = jsonParseEvents(s, &endptr, printer, true);
+            if (status == JSON_OK) {
+                // one document per line
+                while (jsonIsSpace(*endptr))
+                    ++endptr;
+                if (*endptr)
+                    status = JSON_UNEXPECTED_CHARACTER;
+            }
+            if (status == JSON_OK) {
+                slice.out.put('\n');
+            } else {
+                slice.out.size = rollback;
+                slice.failures.push_back(Failure{status, endptr, s, (size_t)(eol - s), slice.lines});
+            }
+        }
+        s = eol + 1;
+    }
+}
+
+// Reads NDJSON in big blocks, cuts each block on line ends into one slice per
+// thread and writes slices in input order. Returns number of bad lines.
+size_t formatStream(FILE *fp, const Options &options) {
+    size_t capacity = LINES_BLOCK_SIZE * options.threads;
+    char *buffer = (char *)checkedRealloc(nullptr, capacity + 1);
+    size_t size = 0;
+    size_t lineno = 1;
+    size_t errors = 0;
+    std::vector<Slice> slices(options.threads);
+    while (true) {
+        size += fread(buffer + size, 1, capacity - size, fp);
+        bool last = size < capacity;
+        char *end = buffer + size;
+        if (!last) {
+            while (end != buffer && end[-1] != '\n')
+                --end;
+            if (end == buffer) {
+                // line longer than whole buffer
+                capacity *= 2;
+                buffer = (char *)checkedRealloc(buffer, capacity + 1);
+                continue;
+            }
+        }
+        buffer[size] = 0;
+
+        char *begin = buffer;
+        for (size_t i = 0; i < slices.size(); ++i) {
+            char *split = buffer + (end - buffer) * (i + 1) / slices.size();
+            if (split < begin)
+                split = begin;
+            while (split > begin && split < end && split[-1] != '\n')
+                ++split;
+            slices[i].begin = begin;
+            slices[i].end = begin = split;
+            slices[i].failures.clear();
+        }
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < slices.size(); ++i)
+            workers.emplace_back(formatLines, std::ref(slices[i]), options.indent);
+        formatLines(slices[0], options.indent);
+        for (auto &t : workers)
+            t.join();
+
+        for (auto &slice : slices) {
+            fwrite(slice.out.data, 1, slice.out.size, stdout);
+            slice.out.size = 0;
+            for (auto &f : slice.failures)
+                printError(options.filename, f.status, f.endptr, f.line, f.size, lineno + f.lineno);
+            errors += slice.failures.size();
+            lineno += slice.lines;
+        }
+
+        if (last)
+            break;
+        size = buffer + size - end;
+        memmove(buffer, end, size);
     }
+    free(buffer);
+    return errors;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-c] [-i width] [-l] [-j threads] [file]\n"
+                    "  -c          compact output\n"
+                    "  -i width    indent width, default %d\n"
+                    "  -l          input is newline delimited JSON, one document per line\n"
+                    "  -j threads  threads for -l, default one per core\n",
+            program, SHIFT_WIDTH);
+    exit(EXIT_FAILURE);
+}
 
-    fprintf(stderr, "\n%*s\n", column + 1, "^");
+// Option value must be decimal number from 0 to max.
+int parseCount(const char *program, const char *s, long max) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end || n < 0 || n > max)
+        usage(program);
+    return (int)n;
 }
 
 int main(int argc, char **argv) {
@@ -159,34 +517,67 @@ int main(int argc, char **argv) {
     });
 #endif
 
-    FILE *fp = (argc > 1 && strcmp(argv[1], "-")) ? fopen(argv[1], "rb") : stdin;
+    Options options = {nullptr, SHIFT_WIDTH, false, std::thread::hardware_concurrency()};
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-c")) {
+            options.indent = 0;
+        } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            options.indent = parseCount(argv[0], argv[++i], 64);
+        } else if (!strcmp(argv[i], "-l")) {
+            options.lines = true;
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            options.threads = parseCount(argv[0], argv[++i], 1024);
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            usage(argv[0]);
+        } else if (!options.filename) {
+            options.filename = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (options.threads == 0)
+        options.threads = 1;
+
+    FILE *fp = (options.filename && strcmp(options.filename, "-")) ? fopen(options.filename, "rb") : stdin;
     if (!fp) {
-        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        fprintf(stderr, "%s: %s: %s\n", argv[0], options.filename, strerror(errno));
         exit(EXIT_FAILURE);
     }
-    char *source = nullptr;
-    size_t sourceSize = 0;
-    size_t bufferSize = 0;
-    while (!feof(fp)) {
-        if (sourceSize + 1 >= bufferSize) {
-            bufferSize = bufferSize < BUFSIZ ? BUFSIZ : bufferSize * 2;
-            source = (char *)realloc(source, bufferSize);
-        }
-        sourceSize += fread(source + sourceSize, 1, bufferSize - sourceSize - 1, fp);
+    if (fp == stdin)
+        options.filename = "-stdin-";
+
+    if (options.lines) {
+        size_t errors = formatStream(fp, options);
+        fclose(fp);
+        return errors ? EXIT_FAILURE : 0;
+    }
+
+    Input input;
+    if (!input.load(fp)) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], options.filename, strerror(errno));
+        exit(EXIT_FAILURE);
     }
     fclose(fp);
-    source[sourceSize] = 0;
 
+    // copy of document is checked first, parser writes into text it has
+    // seen, so broken input prints nothing but error and valid one streams
+    char *copy = (char *)checkedRealloc(nullptr, input.size + 1);
+    memcpy(copy, input.data, input.size + 1);
+    Validator validator;
     char *endptr;
-    JsonValue value;
-    JsonAllocator allocator;
-    int status = jsonParse(source, &endptr, &value, allocator);
+    int status = jsonParseEvents(copy, &endptr, validator, true);
     if (status != JSON_OK) {
-        printError((argc > 1 && strcmp(argv[1], "-")) ? argv[1] : "-stdin-", status, endptr, source, sourceSize);
+        printError(options.filename, status, endptr, copy, input.size);
         exit(EXIT_FAILURE);
     }
-    dumpValue(value);
-    fprintf(stdout, "\n");
+    free(copy);
+
+    Writer out(stdout);
+    Printer printer(out, options.indent);
+    jsonParseEvents(input.data, &endptr, printer);
+    out.put('\n');
+    out.flush();
+    input.release();
 
     return 0;
 }
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
+#include <thread>
 
 static int parsed;
 static int failed;
@@ -27,6 +29,566 @@ void parse(const char *csource, bool ok) {
 #define pass(csource) parse(csource, true)
 #define fail(csource) parse(csource, false)
 
+// Writable copy of test text, parsers modify source in place.
+struct Text {
+    char *s;
+    explicit Text(const char *csource) : s(strdup(csource)) {
+    }
+    Text(const Text &) = delete;
+    ~Text() {
+        free(s);
+    }
+    operator char *() const {
+        return s;
+    }
+};
+
+// Counts one test, on failure prints status, expected one if they differ,
+// and texts test ran on.
+static void check(const char *name, bool ok, int status, const char *a, const char *b = nullptr, int expected = JSON_OK) {
+    if (!ok) {
+        fprintf(stderr, "%s FAILED %d: %s", name, parsed, jsonStrError(status));
+        if (status != expected)
+            fprintf(stderr, " instead of %s", jsonStrError(expected));
+        fprintf(stderr, "\n%s\n", a);
+        if (b)
+            fprintf(stderr, "%s\n", b);
+        ++failed;
+    }
+    ++parsed;
+}
+
+template <typename A, typename B>
+static bool sameTape(const A &a, const B &b) {
+    return a.size() == b.size() && (!a.size() || !memcmp(a.data(), b.data(), a.size()));
+}
+
+// tape parsed from copy of text, so text itself stays intact
+static int tapeOf(const char *csource, JsonTape &tape) {
+    Text source(csource);
+    char *endptr;
+    return jsonParse(source, &endptr, tape);
+}
+
+void tape(const char *csource) {
+    Text source(csource);
+    char *endptr;
+    JsonValue value, decoded;
+    JsonAllocator allocator;
+    JsonTape first, second;
+    int result = jsonParse(source, &endptr, &value, allocator);
+    if (result == JSON_OK)
+        result = jsonEncode(value, first);
+    if (result == JSON_OK)
+        result = jsonDecode(first.data(), first.size(), &decoded, allocator);
+    if (result == JSON_OK)
+        result = jsonEncode(decoded, second);
+    bool ok = result == JSON_OK && sameTape(first, second);
+    // truncated image is refused
+    ok = ok && jsonDecode(first.data(), first.size() - 1, &decoded, allocator) != JSON_OK;
+    check("TAPE", ok, result, csource);
+}
+
+bool same(JsonValue x, JsonTapeValue y) {
+    if (x.getTag() != y.getTag())
+        return false;
+    switch (x.getTag()) {
+    case JSON_NUMBER:
+        return x.toNumber() == y.toNumber();
+    case JSON_STRING:
+        return !strcmp(x.toString(), y.toString());
+    case JSON_ARRAY:
+    case JSON_OBJECT: {
+        auto i = begin(x);
+        auto j = begin(y);
+        for (; i != end(x) && j != end(y); ++i, ++j) {
+            if (x.getTag() == JSON_OBJECT && strcmp(i->key, j->key))
+                return false;
+            if (!same(i->value, j->value))
+                return false;
+        }
+        return !(i != end(x)) && !(j != end(y));
+    }
+    default:
+        return true;
+    }
+}
+
+void relocate(const char *csource) {
+    Text source(csource);
+    char *endptr;
+    JsonValue value;
+    JsonAllocator allocator;
+    JsonTape tape;
+    JsonTapeValue root;
+    int result = jsonParse(source, &endptr, &value, allocator);
+    if (result == JSON_OK)
+        result = tapeOf(csource, tape);
+    size_t size = tape.size();
+    void *moved = malloc(size);
+    memcpy(moved, tape.data(), size);
+    tape.deallocate();
+    if (result == JSON_OK)
+        result = jsonTapeRoot(moved, size, &root);
+    check("RELOCATE", result == JSON_OK && same(value, root), result, csource);
+    free(moved);
+}
+
+template <typename Tape>
+void embedded(const Tape &tape, const char *csource) {
+    JsonTape expected;
+    JsonTapeValue root;
+    int status = tapeOf(csource, expected);
+    if (status == JSON_OK)
+        status = jsonTapeRoot(tape.data(), tape.size(), &root);
+    check("EMBEDDED", status == JSON_OK && sameTape(expected, tape), status, csource);
+}
+
+// Bad literals can not be tested here, each of these must stop compilation:
+//     embed("[1, 2");  embed("[1 2]");  embed("1e400");  embed("-1e309");
+//     embed("[[[...]]]" nested deeper than JSON_STACK_SIZE);
+#define embed(text)                                         \
+    do {                                                    \
+        static constexpr auto tape = JSON_STATIC(text);     \
+        embedded(tape, text);                               \
+    } while (0)
+
+struct Counter {
+    size_t entries;
+    bool enter(JsonValue, const char *key) {
+        entries += key ? 2 : 1;
+        return true;
+    }
+    void leave(JsonValue) {
+    }
+};
+
+struct EventCounter {
+    size_t entries;
+    double sum;
+    int count() {
+        ++entries;
+        return JSON_OK;
+    }
+    int startArray() { return count(); }
+    int endArray() { return JSON_OK; }
+    int startObject() { return count(); }
+    int endObject() { return JSON_OK; }
+    int key(char *, size_t) { return count(); }
+    int string(char *, size_t) { return count(); }
+    int number(double x) {
+        sum += x;
+        return count();
+    }
+    int boolean(bool) { return count(); }
+    int null() { return count(); }
+};
+
+void compact(const char *csource) {
+    Text source(csource);
+    char *endptr;
+    JsonValue value, depth, breadth;
+    JsonAllocator allocator, compacted;
+    JsonTape expected, first, second;
+    Counter counter{0};
+    int result = jsonParse(source, &endptr, &value, allocator);
+    if (result == JSON_OK)
+        result = jsonWalk(value, counter);
+    if (result == JSON_OK)
+        result = jsonCompact(value, &depth, compacted, JSON_DEPTH_FIRST);
+    if (result == JSON_OK)
+        result = jsonCompact(value, &breadth, compacted, JSON_BREADTH_FIRST);
+    memset(source, 0, strlen(csource));
+    allocator.deallocate();
+    if (result == JSON_OK) {
+        tapeOf(csource, expected);
+        jsonEncode(depth, first);
+        jsonEncode(breadth, second);
+    }
+    size_t entries = expected.size() ? ((const uint64_t *)expected.data())[1] : 0;
+    bool ok = result == JSON_OK && counter.entries == entries && sameTape(expected, first) && sameTape(expected, second);
+    check("COMPACT", ok, result, csource);
+}
+
+void events(const char *csource) {
+    Text source(csource);
+    char *endptr;
+    JsonTape expected;
+    EventCounter counter{0, 0};
+    int result = jsonParseEvents(source, &endptr, counter);
+    if (result == JSON_OK)
+        result = tapeOf(csource, expected);
+    size_t entries = 0;
+    double sum = 0;
+    if (result == JSON_OK) {
+        JsonTapeValue root = expected.root();
+        entries = ((const uint64_t *)expected.data())[1];
+        for (const JsonValue *p = root.p, *end = root.skip(); p != end; ++p) {
+            if (p->getTag() == JSON_NUMBER)
+                sum += p->toNumber();
+        }
+    }
+    check("EVENTS", result == JSON_OK && counter.entries == entries && counter.sum == sum, result, csource);
+}
+
+void project(const char *csource, const char *cprojection, const char *cexpected) {
+    Text source(csource);
+    Text projection(cprojection);
+    char *endptr;
+    JsonValue value, filter;
+    JsonAllocator allocator;
+    JsonTape expected, actual;
+    int result = jsonParse(projection, &endptr, &filter, allocator);
+    if (result == JSON_OK)
+        result = jsonParse(source, &endptr, &value, allocator, filter);
+    if (result == JSON_OK) {
+        jsonEncode(value, actual);
+        tapeOf(cexpected, expected);
+    }
+    check("PROJECT", result == JSON_OK && sameTape(expected, actual), result, csource, cprojection);
+}
+
+// Every cell must match member of parsed row, missing, nested and ones not
+// fitting column type are null.
+static bool sameCell(const JsonColumn &column, size_t row, JsonValue record) {
+    JsonNode *member = nullptr;
+    for (auto i : record) {
+        if (!strcmp(i->key, column.name)) {
+            member = i;
+            break;
+        }
+    }
+    bool valid = column.validity[row >> 3] & (1 << (row & 7));
+    if (!member)
+        return !valid;
+    JsonValue value = member->value;
+    bool fits;
+    switch (value.getTag()) {
+    case JSON_NUMBER:
+        fits = column.type == JSON_COLUMN_DOUBLE ||
+               (column.type == JSON_COLUMN_INT64 && value.toNumber() == (double)(int64_t)value.toNumber());
+        break;
+    case JSON_STRING:
+        fits = column.type == JSON_COLUMN_STRING;
+        break;
+    case JSON_TRUE:
+    case JSON_FALSE:
+        fits = column.type == JSON_COLUMN_BOOL;
+        break;
+    default:
+        fits = false;
+    }
+    if (!fits || !valid)
+        return !fits && !valid;
+    switch (column.type) {
+    case JSON_COLUMN_BOOL:
+        return (value.getTag() == JSON_TRUE) == !!(((uint8_t *)column.values)[row >> 3] & (1 << (row & 7)));
+    case JSON_COLUMN_INT64:
+        return value.toNumber() == ((int64_t *)column.values)[row];
+    case JSON_COLUMN_DOUBLE:
+        return value.toNumber() == ((double *)column.values)[row];
+    case JSON_COLUMN_STRING:
+        return strlen(value.toString()) == (size_t)(column.offsets[row + 1] - column.offsets[row]) &&
+               !memcmp(value.toString(), column.data + column.offsets[row], column.offsets[row + 1] - column.offsets[row]);
+    default:
+        return false;
+    }
+}
+
+// types holds expected type digit of every column in order
+void columns(const char *crecords, const char *schema, const char *types) {
+    std::string clines;
+    for (const char *s = crecords + 1; *s; ++s)
+        clines += *s == '\x1F' ? '\n' : *s;
+    clines.erase(clines.size() - 1);
+    std::string carray(crecords);
+    for (auto &c : carray)
+        c = c == '\x1F' ? ',' : c;
+    Text array(carray.c_str());
+    Text lines(clines.c_str());
+    char *endptr;
+    JsonValue value;
+    JsonAllocator allocator;
+    JsonColumns fromTree(!schema), fromLines(!schema);
+    for (const char *s = schema; s && *s; s += strlen(s) + 1) {
+        fromTree.declare(s + 1, (JsonColumnType)(*s - '0'));
+        fromLines.declare(s + 1, (JsonColumnType)(*s - '0'));
+    }
+    int status = jsonExtractLines(lines, &endptr, fromLines);
+    if (status == JSON_OK)
+        status = jsonParse(array, &endptr, &value, allocator);
+    if (status == JSON_OK)
+        status = jsonExtract(value, fromTree);
+    bool ok = status == JSON_OK && fromTree.size() == strlen(types) && fromLines.size() == strlen(types) &&
+              fromTree.length() == fromLines.length();
+    for (size_t i = 0; ok && i < fromTree.size(); ++i) {
+        const JsonColumn &column = fromTree[i];
+        const JsonColumn *other = fromLines.find(column.name);
+        ok = other && column.type == types[i] - '0' && other->type == column.type && other->nulls == column.nulls;
+        size_t row = 0;
+        for (auto record : value) {
+            ok = ok && sameCell(column, row, record->value) && sameCell(*other, row, record->value);
+            ++row;
+        }
+    }
+    check("COLUMNS", ok, status, crecords);
+}
+
+void diff(const char *cfrom, const char *cto, const char *cexpected) {
+    Text from(cfrom);
+    Text to(cto);
+    Text expected(cexpected);
+    char *endptr;
+    JsonValue a, b, patch, result;
+    JsonAllocator allocator;
+    int status = jsonParse(from, &endptr, &a, allocator);
+    if (status == JSON_OK)
+        status = jsonParse(to, &endptr, &b, allocator);
+    if (status == JSON_OK)
+        status = jsonParse(expected, &endptr, &result, allocator);
+    if (status == JSON_OK)
+        status = jsonDiff(a, b, &patch, allocator);
+    bool ok = status == JSON_OK && jsonEqual(patch, result) && jsonEqual(a, b) == !patch.toNode() && jsonEqual(b, b);
+    check("DIFF", ok, status, cfrom, cto);
+}
+
+void hash(const char *ca, const char *cb) {
+    Text a(ca);
+    Text b(cb);
+    char *endptr;
+    JsonValue x, y;
+    JsonAllocator allocator;
+    JsonHashCache cache(allocator);
+    JsonHash hx, hy, cached, again;
+    int status = jsonParse(a, &endptr, &x, allocator);
+    if (status == JSON_OK)
+        status = jsonParse(b, &endptr, &y, allocator);
+    if (status == JSON_OK)
+        status = jsonHash(x, &hx);
+    if (status == JSON_OK)
+        status = jsonHash(y, &hy);
+    if (status == JSON_OK)
+        status = jsonHash(x, &cached, &cache);
+    if (status == JSON_OK)
+        status = jsonHash(x, &again, &cache);
+    bool ok = status == JSON_OK && (hx == hy) == jsonEqual(x, y) && jsonEqual(x, y) == jsonEqual(y, x) && cached == hx && again == hx;
+    ok = ok && jsonEqual(x, y, cache) == jsonEqual(x, y) && jsonEqual(y, x, cache) == jsonEqual(x, y);
+    // members of cached container come from cache and still match
+    if (ok && x.getTag() == JSON_OBJECT) {
+        for (auto i : x) {
+            JsonHash member, fresh;
+            jsonHash(i->value, &member, &cache);
+            jsonHash(i->value, &fresh);
+            ok = ok && member == fresh;
+        }
+    }
+    check("HASH", ok, status, ca, cb);
+}
+
+// local is whether only part of the text is parsed again
+void reparse(const char *before, size_t offset, size_t removed, const char *inserted, bool local) {
+    std::string text(before);
+    text.replace(offset, removed, inserted);
+    size_t size = text.size();
+    char *source = (char *)malloc(strlen(before) > size ? strlen(before) + 1 : size + 1);
+    strcpy(source, before);
+    Text copy(text.c_str());
+    char *endptr, *expectedEnd;
+    JsonValue value;
+    JsonAllocator allocator;
+    JsonTape expected, actual;
+    int result = jsonParse(source, &endptr, &value, allocator);
+    // root bracket is never in reparsed span, only full parse restores it
+    source[0] = '?';
+    if (result == JSON_OK)
+        result = jsonReparse(source, text.c_str(), size, JsonEdit{offset, removed, strlen(inserted)}, &endptr, &value, allocator);
+    int status = jsonParse(copy, &expectedEnd, expected);
+    bool ok = result == status;
+    if (ok && status == JSON_OK)
+        ok = (source[0] == '?') == local && jsonEncode(value, actual) == JSON_OK && sameTape(expected, actual);
+    else if (ok)
+        ok = endptr - source == expectedEnd - copy.s;
+    check("REPARSE", ok, result, before, text.c_str(), status);
+    free(source);
+}
+
+void locate(const char *csource, size_t line, size_t column, const char *path) {
+    Text source(csource);
+    char *endptr;
+    JsonValue value;
+    JsonAllocator allocator;
+    JsonError error;
+    int status = jsonParse(source, &endptr, &value, allocator, &error);
+    // without JsonError strings are not marked
+    Text plain(csource);
+    char *plainEnd;
+    jsonParse(plain, &plainEnd, &value, allocator);
+    bool marked = memchr(plain, JSON_STRING_MARK, plainEnd - plain.s) != nullptr;
+    bool ok = status != JSON_OK && !marked && error.offset == (size_t)(endptr - source.s) &&
+              error.line == line && error.column == column && !strcmp(error.path, path);
+    std::string where = std::to_string(error.line) + ":" + std::to_string(error.column) + " " + error.path;
+    check("LOCATE", ok, status, csource, where.c_str(), status);
+}
+
+// position of first bad record among count records
+void batch(const char *ctext, size_t count, size_t bad, size_t line, size_t column) {
+    Text text(ctext);
+    JsonAllocator allocator;
+    JsonRecords records(text);
+    JsonValue value;
+    JsonError error, first = {0, 0, 0, nullptr};
+    size_t total = 0, errors = 0;
+    int status;
+    while (jsonParseRecord(records, &status, &value, allocator, &error)) {
+        ++total;
+        if (status != JSON_OK && !errors++)
+            first = error;
+    }
+    size_t offset = 0;
+    for (size_t i = 1; i < line; ++i)
+        offset = strchr(ctext + offset, '\n') - ctext + 1;
+    bool ok = total == count && errors == bad && (!bad || (first.line == line && first.column == column && first.offset == offset + column - 1));
+    std::string where = std::to_string(errors) + "/" + std::to_string(total) + " " +
+                        std::to_string(first.line) + ":" + std::to_string(first.column);
+    check("BATCH", ok, JSON_OK, ctext, where.c_str());
+}
+
+void limited(const char *csource, JsonLimits limits, int expected) {
+    Text source(csource);
+    char *endptr;
+    JsonValue value;
+    JsonAllocator allocator;
+    int status = jsonParse(source, &endptr, &value, allocator, limits);
+    check("LIMITED", status == expected, status, csource, nullptr, expected);
+}
+
+void shared(const char *csource) {
+    JsonZonePool pool;
+    JsonDocument *document = nullptr;
+    int result = jsonParse(csource, strlen(csource), &document, &pool);
+    size_t expected = 0;
+    if (result == JSON_OK) {
+        Counter counter{0};
+        jsonWalk(document->value(), counter);
+        expected = counter.entries;
+    }
+    std::atomic<int> errors(0);
+    std::thread threads[4];
+    for (auto &t : threads) {
+        if (result != JSON_OK)
+            break;
+        document->retain();
+        t = std::thread([&, document] {
+            for (int i = 0; i < 100; ++i) {
+                Counter counter{0};
+                jsonWalk(document->value(), counter);
+                JsonAllocator allocator(pool);
+                Text source(csource);
+                char *endptr;
+                JsonValue value;
+                if (counter.entries != expected || jsonParse(source, &endptr, &value, allocator) != JSON_OK)
+                    ++errors;
+            }
+            document->release();
+        });
+    }
+    if (document)
+        document->release();
+    for (auto &t : threads) {
+        if (t.joinable())
+            t.join();
+    }
+    check("SHARED", result == JSON_OK && !errors, result, csource);
+}
+
+static bool inArena(JsonValue o, const JsonArena &arena) {
+    if (o.getTag() != JSON_ARRAY && o.getTag() != JSON_OBJECT)
+        return true;
+    for (auto i : o) {
+        if (!arena.contains(i) || !inArena(i->value, arena))
+            return false;
+    }
+    return true;
+}
+
+// parses text copies times into arena of minimal size, so that it runs out
+void arena(const char *csource, size_t copies) {
+    JsonArena arena(1);
+    JsonZonePool pool(arena);
+    JsonAllocator allocator(pool);
+    JsonValue first, value;
+    char *endptr;
+    bool ok = arena.size() && !(arena.size() & (arena.size() - 1));
+    // strings of first copy are compared with all others
+    Text head(csource);
+    int status = jsonParse(head, &endptr, &first, allocator);
+    value = first;
+    for (size_t i = 1; i < copies && status == JSON_OK; ++i) {
+        Text source(csource);
+        status = jsonParse(source, &endptr, &value, allocator);
+        ok = ok && jsonEqual(first, value);
+    }
+    ok = ok && inArena(first, arena) && !inArena(value, arena);
+    // freed zones of arena are reused before malloc
+    allocator.deallocate();
+    Text again(csource);
+    if (status == JSON_OK)
+        status = jsonParse(again, &endptr, &value, allocator);
+    ok = ok && inArena(value, arena);
+
+    // blocks bigger than zone come from arena, zones of arena never move to
+    // allocator of other pool
+    JsonArena other(1);
+    JsonZonePool otherPool(other);
+    JsonAllocator stranger(otherPool);
+    void *block = stranger.allocate(3 * 4096);
+    ok = ok && block && other.contains(block) && allocator.allocate(16);
+    ok = ok && !allocator.merge(stranger) && !stranger.merge(allocator);
+
+    std::string big("[");
+    while (big.size() < 4 * 65536)
+        big.append(csource).append(", ");
+    big.append(csource).append("]");
+    JsonArena large(big.size() * 4);
+    JsonZonePool shared(large);
+    JsonAllocator threads(shared);
+    Text whole(big.c_str());
+    if (status == JSON_OK)
+        status = jsonParseParallel(whole, big.size(), &endptr, &value, threads, 4);
+    ok = ok && inArena(value, large);
+    check("ARENA", status == JSON_OK && ok, status, csource);
+}
+
+// parallel parse must give the same status, endptr and tree as sequential,
+// damage overwrites three bytes picked by that seed
+void parallel(const char *record, bool object, size_t count, const char *prefix = "", unsigned damage = 0) {
+    std::string csource(prefix);
+    csource += object ? "{" : "[";
+    for (size_t i = 0; i < count; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "%s\"k%zu\": ", i ? ", " : "", i);
+        csource += object ? key : (i ? ", " : "");
+        csource += record;
+    }
+    csource += object ? "}" : "]";
+    for (int i = 0; damage && i < 3; ++i) {
+        damage = damage * 1103515245 + 12345;
+        csource[(damage >> 8) % csource.size()] = "{}[]\",:x\\ "[(damage >> 4) % 10];
+    }
+    Text source(csource.c_str());
+    Text copy(csource.c_str());
+    char *endptr, *expectedEnd;
+    JsonValue value;
+    JsonAllocator allocator;
+    JsonTape expected, actual;
+    int result = jsonParseParallel(source, csource.size(), &endptr, &value, allocator, 4);
+    int status = jsonParse(copy, &expectedEnd, expected);
+    if (result == JSON_OK)
+        jsonEncode(value, actual);
+    bool ok = result == status && endptr - source.s == expectedEnd - copy.s && sameTape(expected, actual);
+    check("PARALLEL", ok, result, record, nullptr, status);
+}
+
 int main() {
       pass(u8R"json(1234567890)json");
       pass(u8R"json(1e-21474836311)json");
@@ -137,6 +699,140 @@ break"])json");
 1e00,2e+00,2e-00
 ,"rosebud"])json");
 
+    const char *config = u8R"json({"name": "svc", "limits": {"cpu": 2, "mem": "1\tG", "tags": ["a", "b"]}, "peers": [{"host": "x"}], "on": true})json";
+    const char *nested = u8R"json({"a": [1, 2.5, "three", {}], "b": {"c": [true, false, null], "": "\u0123"}, "d": []})json";
+
+    // copies of tree: binary tape, embedded tape and compacted nodes
+    tape(u8R"json(-42)json");
+    tape(u8R"json("string")json");
+    tape(u8R"json([])json");
+    tape(nested);
+    relocate(u8R"json(3.5)json");
+    relocate(u8R"json([[], {}, [[1]], {"x": {"y": "z"}}, "s", null])json");
+    relocate(nested);
+    embed(u8R"json({"name": "svc", "limits": {"cpu": 2, "mem": "1\tG", "tags": ["a", "b"]}, "peers": [{"host": "x"}], "on": true})json");
+    embed(u8R"json([0, -0, 0.1, -2.5E+3, 1e-310, 5e-324, 1e308, 123456789012345678, 1e22, -.5])json");
+    embed(u8R"json({"": "", "\u00e9\u20ac\n\/\"": [[], {}, [null, false]], "k": {"k": {"k": "\\"}}})json");
+    embed(u8R"json(  "scalar"  )json");
+    embed(u8R"json(-1.5e-7)json");
+    compact(u8R"json("string")json");
+    compact(u8R"json([[], {}, [[1]], {"x": {"y": "z"}}, "s", null])json");
+    compact(nested);
+
+    // parser events: counting, projection and columns
+    events(u8R"json(-42)json");
+    events(nested);
+    project(config, u8R"json({"name": 1, "limits": {"tags": 1}, "on": 1})json",
+            u8R"json({"name": "svc", "limits": {"tags": ["a", "b"]}, "on": true})json");
+    project(config, u8R"json({"peers": {"host": 1}, "missing": {}})json", u8R"json({"peers": [{"host": "x"}]})json");
+    project(config, u8R"json({"limits": {}})json", u8R"json({"limits": {}})json");
+    project(config, u8R"json(true)json", config);
+    project(u8R"json({"a" 1, "b": 2})json", u8R"json({"b": 1})json", u8R"json({"b": 2})json");
+    project(u8R"json([{"a" {"x": [1]} "b" "y"}, {"a": 1 , "b" : "z"}])json", u8R"json({"b": 1})json", u8R"json([{"b": "y"}, {"b": "z"}])json");
+    project(u8R"json([{"a": "\"}]\\", "b": [{"a": 1}, "]"]}, {"b": -0.5e1, "a": {"x": [[]]}}])json",
+            u8R"json({"a": 1})json", u8R"json([{"a": "\"}]\\"}, {"a": {"x": [[]]}}])json");
+    const char *records = "[{\"id\": 1, \"name\": \"a\", \"ok\": true, \"tags\": [1]}\x1F"
+                          "{\"id\": 2, \"name\": \"b\\\"c\", \"ok\": false, \"tags\": []}\x1F"
+                          "{\"ok\": null, \"name\": \"\", \"id\": 3.5, \"extra\": \"x\"}\x1F"
+                          "{\"late\": null, \"id\": -4, \"id\": \"dup\"}\x1F"
+                          "{\"late\": 7}]";
+    columns(records, nullptr, "34142");
+    columns(records, "2late\0" "4name\0", "24");
+    columns("[{\"a\": 1}\x1F{}\x1F{\"a\": [{\"b\": 2}]}\x1F{\"b\": {}, \"a\": 2}]", nullptr, "2");
+    const char *mixed = "[{\"a\": true, \"b\": 1, \"c\": 1e300}\x1F{\"a\": \"x\", \"b\": 2.5, \"c\": 2}\x1F"
+                        "{\"a\": false, \"b\": \"y\", \"c\": -3}\x1F{\"b\": -9007199254740993}]";
+    columns(mixed, nullptr, "133");
+    columns(mixed, "2b\0", "2");
+
+    // comparison: patch, hash and equality
+    diff(u8R"json({"a": 1, "b": [1, 2, 3], "c": {"x": null}})json", u8R"json({"c": {"x": null}, "b": [1, 2, 3], "a": 1})json", "[]");
+    diff(u8R"json([1, "x", [true]])json", u8R"json({})json", u8R"json([{"op": "replace", "path": "", "value": {}}])json");
+    diff(u8R"json({"a": 1, "b": [1, 2, 3], "c/d": {"e~f": "g"}, "h": 0})json",
+         u8R"json({"i": [], "b": [1, 5], "c/d": {"e~f": "G"}, "a": 1})json",
+         u8R"json([{"op": "replace", "path": "/b/1", "value": 5}, {"op": "remove", "path": "/b/2"},
+                   {"op": "replace", "path": "/c~1d/e~0f", "value": "G"}, {"op": "remove", "path": "/h"},
+                   {"op": "add", "path": "/i", "value": []}])json");
+    diff(u8R"json({"k0": 0, "k1": 1, "k2": 2, "k3": 3, "k4": 4, "k5": 5, "k6": 6, "k7": 7, "k8": 8, "k9": 9, "l": [[]]})json",
+         u8R"json({"l": [[], [0]], "k9": 9, "k8": 8, "k7": 7, "k6": 6, "k5": 5, "k4": 4, "k3": 3, "k2": 2, "k1": 1, "k0": 0})json",
+         u8R"json([{"op": "add", "path": "/l/1", "value": [0]}])json");
+    diff(u8R"json({"x": 1, "x": 1})json", u8R"json({"x": 1, "y": 2})json",
+         u8R"json([{"op": "remove", "path": "/x"}, {"op": "add", "path": "/y", "value": 2}])json");
+    diff(u8R"json({"x": 1})json", u8R"json({"x": 1, "x": 1})json", u8R"json([{"op": "add", "path": "/x", "value": 1}])json");
+    hash(u8R"json({"a": [1, -0, "x"], "b": {"c": null, "d": true}})json", u8R"json({ "b" : {"d":true,"c":null},"a":[1,0,"x"]})json");
+    hash(u8R"json({"a": [1, 2], "b": {}})json", u8R"json({"a": [2, 1], "b": {}})json");
+    hash(u8R"json({"a": "b"})json", u8R"json({"b": "a"})json");
+    hash(u8R"json([[], {}, "", 0, false])json", u8R"json([{}, [], "", 0, false])json");
+    hash(u8R"json("a long string that needs more than one word")json", u8R"json("a long string that needs more than one word!")json");
+    hash(u8R"json({"x": 1, "x": 1})json", u8R"json({"x": 1, "y": 2})json");
+    hash(u8R"json({"x": 1, "x": 2})json", u8R"json({"x": 2, "x": 1})json");
+    hash(u8R"json({"x": 1, "y": 3, "x": [2]})json", u8R"json({"y": 3, "x": [2], "x": 1})json");
+    hash(u8R"json({"x": [1], "x": [1]})json", u8R"json({"x": [1], "x": [2]})json");
+
+    // edits parsed again in place
+    reparse(config, 10, 3, "service", true);
+    reparse(config, 34, 1, "16", true);
+    reparse(config, 44, 6, "\"512M\"", true);
+    reparse(config, 69, 0, ", \"c\"", true);
+    reparse(config, 61, 5, "", true);
+    reparse(config, 36, 0, "}", false);
+    reparse(config, 92, 3, "false", true);
+    reparse(config, 105, 4, "[1, {\"x\": 2}]", true);
+    reparse(config, 1, 6, "\"title\"", false);
+    reparse(config, 2, 4, "\\u0041", true);
+    const char *rows = u8R"json([{"id": 1, "tags": ["a"]}, {"id": 2, "name": "bob"}, {"id": 3}])json";
+    reparse(rows, 46, 3, "robert", true);
+    reparse(rows, 34, 1, "22", true);
+    reparse(rows, 23, 0, ", \"b\"", true);
+    reparse(rows, 62, 0, ", {\"id\": 4}", false);
+    reparse("[1, 2, 3]", 4, 1, "20", false);
+    reparse(u8R"json({"m": [["a", "b"]], "n": 1})json", 14, 1, "bc", true);
+    // value pushed against next token fails as in full parse
+    reparse(u8R"json({"a": null, "b": "c"})json", 10, 2, "", false);
+    reparse(u8R"json({"a": 2.5E-22, "~": 1})json", 13, 2, "", false);
+    reparse(u8R"json({"a": "x", "b": 1})json", 9, 2, "", false);
+
+    // error locations and limits
+    locate(u8R"json({"a": "x\ny\n", "b": {"c/~": [1, 2, tru]}})json", 1, 40, "/b/c~1~0/2");
+    locate("[\n  {\"a\": 1},\n  {\"a\": \"\\n\" : 2}\n]", 3, 14, "/1");
+    locate("{\"a\": [[], [-]]}", 1, 14, "/a/1/0");
+    locate("{\"a\": [\n\"\t\"]}", 2, 2, "/a/0");
+    locate("[1, 2,\n", 2, 1, "/2");
+    locate("[\"\\u000a\", \"\\\"\\t\",\n x]", 2, 2, "/2");
+    locate("[\"a\\\\b\nc\"]", 1, 7, "/0");
+    locate("{\"k\": \"\\\"x\n\"}", 1, 11, "/k");
+    batch("[1]\n\n  \n{\"a\": nul}\n[2] [3]\n{\"b\": \"\\n\"}\n[", 5, 3, 4, 10);
+    batch("1\n2\n\n", 2, 0, 0, 0);
+    batch("", 0, 0, 0, 0);
+    limited(config, JsonLimits{strlen(config), 12, 240, 6, {}}, JSON_OK);
+    limited(config, JsonLimits{strlen(config) - 1, 0, 0, 0, {}}, JSON_INPUT_TOO_LARGE);
+    limited(config, JsonLimits{0, 11, 0, 0, {}}, JSON_TOO_MANY_NODES);
+    limited(config, JsonLimits{0, 0, 239, 0, {}}, JSON_MEMORY_LIMIT);
+    limited(config, JsonLimits{0, 0, 0, 5, {}}, JSON_STRING_TOO_LONG);
+    std::string nulls("[null");
+    for (int i = 0; i < 10000; ++i)
+        nulls += ",null";
+    nulls += "]";
+    limited(nulls.c_str(), JsonLimits{0, 0, 0, 0, std::chrono::steady_clock::now()}, JSON_DEADLINE_EXCEEDED);
+    limited(nulls.c_str(), JsonLimits{0, 0, 0, 0, std::chrono::steady_clock::now() + std::chrono::hours(1)}, JSON_OK);
+
+    // memory pools and threads
+    shared(config);
+    arena(config, 20000);
+    parallel(config, false, 4096);
+    parallel(config, true, 4096);
+    parallel(u8R"json({"s": "\\\"]}, [{\\", "n": [-1.5e3, [[]]], "e": {}})json", false, 8192);
+    parallel(u8R"json(["\\\\", "\",\"", 0, [{"]": "["}]])json", true, 8192);
+    std::string deep(JSON_STACK_SIZE, '[');
+    deep += std::string(JSON_STACK_SIZE, ']');
+    parallel(deep.c_str(), false, 8192);
+    parallel(deep.substr(1, 2 * JSON_STACK_SIZE - 2).c_str(), true, 8192);
+    parallel("1", false, 100000, "[1, 2] ");
+    for (unsigned seed = 1; seed <= 200; ++seed)
+        parallel(config, seed & 1, 4096, "", seed);
+    // these put bracket in place of member key or value
+    for (unsigned seed : {369, 415, 573, 857, 1881})
+        parallel(config, true, 4096, "", seed);
+
     if (failed)
         fprintf(stderr, "%d/%d TESTS FAILED\n", failed, parsed);
     else